@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -66,37 +67,41 @@ typedef struct {
 } Buffer;
 
 typedef struct {
-    FILE *file;  // stream backed by FILE *
-    char *p;     // stream backed by string
+    char *p;     // read position
+    char *data;  // file contents. NULL if string-backed file
+    int size;
+    int *lines;  // line index built by source_line()
+    int nlines;
     char *name;
     int line;
     int column;
     int ntok;     // token counter
+    int depth;    // nesting level of #include
     int last;     // the last character read from file
     int buf[3];   // push-back buffer for unread operations
     int buflen;   // push-back buffer size
     time_t mtime; // last modified time. 0 if string-backed file
 } File;
 
+// Fields are ordered to avoid padding; a token is 48 bytes.
 typedef struct {
     int kind;
-    File *file;
-    int line;
-    int column;
     bool space;   // true if the token has a leading space
     bool bol;     // true if the token is at the beginning of a line
+    char enc;     // TSTRING or TCHAR: encoding prefix
+    int line;
+    int column;
     int count;    // token number in a file, counting from 0.
+    int slen;     // TSTRING: length including the terminating NUL
+    File *file;
     Set *hideset; // used by the preprocessor for macro expansion
     union {
         // TKEYWORD
         int id;
-        // TSTRING or TCHAR
-        struct {
-            char *sval;
-            int slen;
-            int c;
-            int enc;
-        };
+        // TCHAR or TINVALID
+        int c;
+        // TIDENT, TNUMBER or TSTRING
+        char *sval;
         // TMACRO_PARAM
         struct {
             bool is_vararg;
@@ -180,6 +185,7 @@ typedef struct Type {
     Dict *fields;
     int offset;
     bool is_struct; // true if struct, false if union
+    char *tag;      // NULL if untagged
     // bitfield
     int bitoff;
     int bitsize;
@@ -188,17 +194,16 @@ typedef struct Type {
     Vector *params;
     bool hasva;
     bool oldstyle;
+    bool isinline;
 } Type;
 
-typedef struct {
-    char *file;
-    int line;
-} SourceLoc;
-
+// Nodes are allocated only as large as the union member their kind
+// uses (see node_size() in parse.c). Do not change the kind of an
+// existing node to one that uses a larger member.
 typedef struct Node {
     int kind;
+    unsigned loc; // packed source location, 0 if unknown
     Type *ty;
-    SourceLoc *sourceLoc;
     union {
         // Char, int, or long
         long ival;
@@ -217,6 +222,9 @@ typedef struct Node {
             char *varname;
             // local
             int loff;
+            bool addrtaken; // set by the optimizer if the address escapes
+            int nuses;      // number of references, counted by the optimizer
+            char *lreg;     // callee-saved register holding the variable
             Vector *lvarinit;
             // global
             char *glabel;
@@ -259,6 +267,7 @@ typedef struct Node {
             struct Node *cond;
             struct Node *then;
             struct Node *els;
+            int profid;     // profile counter of the then branch, 0 if none
         };
         // Goto and label
         struct {
@@ -316,19 +325,32 @@ char *quote_cstring_len(char *p, int len);
 char *quote_char(char c);
 
 // cpp.c
+extern bool include_stats;
+extern bool macro_report;
+extern int macro_report_limit;
+extern bool linemarkers;
 void read_from_string(char *buf);
+void cpp_read_from_string(char *buf);
 bool is_ident(Token *tok, char *s);
 void expect_newline(void);
 void add_include_path(char *path);
 void init_now(void);
 void cpp_init(void);
+void cpp_init_standalone(void);
 Token *peek_token(void);
 Token *read_token(void);
+void print_include_stats(void);
+void print_macro_report(void);
+Vector *header_dependencies(bool system);
+void *cpp_save(void);
+void cpp_restore(void *state);
+void write_preprocessed(FILE *fp);
 
 // debug.c
 char *ty2s(Type *ty);
 char *node2s(Node *node);
 char *tok2s(Token *tok);
+char *encoding_prefix(int enc);
 
 // dict.c
 Dict *make_dict(void);
@@ -349,6 +371,9 @@ extern bool warning_is_error;
 #define warn(...)        warnf(__FILE__ ":" STR(__LINE__), NULL, __VA_ARGS__)
 #define warnt(tok, ...)  warnf(__FILE__ ":" STR(__LINE__), token_pos(tok), __VA_ARGS__)
 
+extern jmp_buf *error_jmp;
+extern char *error_message;
+
 noreturn void errorf(char *line, char *pos, char *fmt, ...);
 void warnf(char *line, char *pos, char *fmt, ...);
 char *token_pos(Token *tok);
@@ -364,14 +389,25 @@ int stream_depth(void);
 char *input_position(void);
 void stream_stash(File *f);
 void stream_unstash(void);
+void *stream_save(void);
+void stream_restore(void *state);
+char *source_line(char *name, int line, int *len);
 
 // gen.c
+extern bool instrument_functions;
+extern bool instrument_cycles;
+extern bool debug_info;
 void set_output_file(FILE *fp);
 void close_output_file(void);
 void emit_toplevel(Node *v);
+bool is_vector_loop(Vector *stmts, int i);
+void emit_profile_runtime(void);
+void emit_cycle_table(void);
+void emit_debug_info(void);
 
 // lex.c
 void lex_init(char *filename);
+void lex_init_file(File *f);
 char *get_base_file(void);
 void skip_cond_incl(void);
 char *read_header_file_name(bool *std);
@@ -381,6 +417,21 @@ void token_buffer_unstash();
 void unget_token(Token *tok);
 Token *lex_string(char *s);
 Token *lex(void);
+Token *copy_token(Token *tok);
+void *lex_save(void);
+void lex_restore(void *state);
+
+// libcpp.c
+typedef struct Preprocessor Preprocessor;
+Preprocessor *pp_new(void);
+void pp_add_include_path(Preprocessor *pp, char *dir);
+void pp_define(Preprocessor *pp, char *def);
+void pp_undef(Preprocessor *pp, char *name);
+int pp_open_file(Preprocessor *pp, char *path);
+int pp_open_buffer(Preprocessor *pp, char *name, char *buf);
+int pp_read(Preprocessor *pp, Token **buf, int n);
+Vector *pp_dependencies(Preprocessor *pp, bool system);
+char *pp_error(Preprocessor *pp);
 
 // map.c
 Map *make_map(void);
@@ -390,6 +441,18 @@ void map_put(Map *m, char *key, void *val);
 void map_remove(Map *m, char *key);
 size_t map_len(Map *m);
 
+// opt.c
+extern int optlevel;
+extern bool profile_generate;
+extern bool profile_use;
+extern char *profile_file;
+Vector *optimize(Vector *toplevels);
+int profile_size(void);
+unsigned profile_checksum(void);
+int profile_func_counter(Node *func);
+long profile_count(int id);
+int func_hotness(Node *func);
+
 // parse.c
 char *make_tempname(void);
 char *make_label(void);
@@ -401,6 +464,9 @@ Node *read_expr(void);
 Vector *read_toplevels(void);
 void parse_init(void);
 char *fullpath(char *path);
+Node *copy_node(Node *node);
+char *loc_file(unsigned loc);
+int loc_line(unsigned loc);
 
 // set.c
 Set *set_add(Set *s, char *v);
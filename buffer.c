@@ -112,6 +112,7 @@ char *quote_cstring(char *p) {
     Buffer *b = make_buffer();
     while (*p)
         print(b, *p++);
+    buf_write(b, '\0');
     return buf_body(b);
 }
 
@@ -119,6 +120,7 @@ char *quote_cstring_len(char *p, int len) {
     Buffer *b = make_buffer();
     for (int i = 0; i < len; i++)
         print(b, p[i]);
+    buf_write(b, '\0');
     return buf_body(b);
 }
 
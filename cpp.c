@@ -6,20 +6,27 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "8cc.h"
 
 static Map *macros = &EMPTY_MAP;
-static Map *once = &EMPTY_MAP;
+static Map *once = &EMPTY_MAP;          // file ID -> (void *)1
 static Map *keywords = &EMPTY_MAP;
-static Map *include_guard = &EMPTY_MAP;
+static Map *include_guard = &EMPTY_MAP; // file ID -> guard macro name
+static int macro_gen = 1;               // incremented when macros change
+static bool macro_expanded;             // set on each macro expansion
 static Vector *cond_incl_stack = &EMPTY_VECTOR;
 static Vector *std_include_path = &EMPTY_VECTOR;
+static int counter;                     // the value of __COUNTER__
 static struct tm now;
 static Token *cpp_token_zero = &(Token){ .kind = TNUMBER, .sval = "0" };
 static Token *cpp_token_one = &(Token){ .kind = TNUMBER, .sval = "1" };
@@ -41,14 +48,19 @@ typedef struct {
     Vector *body;
     bool is_varg;
     SpecialMacroHandler *fn;
+    // Memoized expansion of an object-like macro; valid if memo_gen
+    // equals macro_gen. NULL if the expansion can't be memoized.
+    Vector *memo;
+    int memo_gen;
 } Macro;
 
 static Macro *make_obj_macro(Vector *body);
 static Macro *make_func_macro(Vector *body, int nargs, bool is_varg);
 static Macro *make_special_macro(SpecialMacroHandler *fn);
-static void define_obj_macro(char *name, Token *value);
 static void read_directive(Token *hash);
 static Token *read_expand(void);
+static Token *read_cpp_token(void);
+static char *file_id(char *path);
 
 /*
  * Constructors
@@ -81,20 +93,7 @@ static Macro *make_special_macro(SpecialMacroHandler *fn) {
 }
 
 static Token *make_macro_token(int position, bool is_vararg) {
-    Token *r = malloc(sizeof(Token));
-    r->kind = TMACRO_PARAM;
-    r->is_vararg = is_vararg;
-    r->hideset = NULL;
-    r->position = position;
-    r->space = false;
-    r->bol = false;
-    return r;
-}
-
-static Token *copy_token(Token *tok) {
-    Token *r = malloc(sizeof(Token));
-    *r = *tok;
-    return r;
+    return copy_token(&(Token){ TMACRO_PARAM, .is_vararg = is_vararg, .position = position });
 }
 
 static void expect(char id) {
@@ -119,12 +118,51 @@ static bool next(int id) {
     return false;
 }
 
-static void propagate_space(Vector *tokens, Token *tmpl) {
-    if (vec_len(tokens) == 0)
+// Gives tokens[i] the spacing of tmpl.
+static void propagate_space(Vector *tokens, int i, Token *tmpl) {
+    if (vec_len(tokens) <= i || ((Token *)vec_get(tokens, i))->space == tmpl->space)
         return;
-    Token *tok = copy_token(vec_head(tokens));
+    Token *tok = copy_token(vec_get(tokens, i));
     tok->space = tmpl->space;
-    vec_set(tokens, 0, tok);
+    vec_set(tokens, i, tok);
+}
+
+// The first token of a macro expansion takes the place of the macro
+// name: it gets the name's spacing, beginning-of-line flag and position.
+static Token *at_position(Token *tok, Token *tmpl) {
+    if (tok->space == tmpl->space && tok->bol == tmpl->bol && tok->file == tmpl->file &&
+        tok->line == tmpl->line && tok->column == tmpl->column)
+        return tok;
+    tok = copy_token(tok);
+    tok->space = tmpl->space;
+    tok->bol = tmpl->bol;
+    tok->file = tmpl->file;
+    tok->line = tmpl->line;
+    tok->column = tmpl->column;
+    return tok;
+}
+
+static void propagate_position(Vector *tokens, Token *tmpl) {
+    if (vec_len(tokens) > 0)
+        vec_set(tokens, 0, at_position(vec_head(tokens), tmpl));
+}
+
+/*
+ * Vector pool
+ *
+ * Argument lists and rescanning buffers are needed only while a macro
+ * invocation is expanded, so their vectors are recycled.
+ */
+
+static Vector *vector_pool = &EMPTY_VECTOR;
+
+static Vector *get_vector() {
+    return vec_len(vector_pool) ? vec_pop(vector_pool) : make_vector();
+}
+
+static void put_vector(Vector *vec) {
+    vec->len = 0;
+    vec_push(vector_pool, vec);
 }
 
 /*
@@ -145,7 +183,7 @@ void expect_newline() {
 }
 
 static Vector *read_one_arg(Token *ident, bool *end, bool readall) {
-    Vector *r = make_vector();
+    Vector *r = get_vector();
     int level = 0;
     for (;;) {
         Token *tok = lex();
@@ -183,14 +221,14 @@ static Vector *read_one_arg(Token *ident, bool *end, bool readall) {
 }
 
 static Vector *do_read_args(Token *ident, Macro *macro) {
-    Vector *r = make_vector();
+    Vector *r = get_vector();
     bool end = false;
     while (!end) {
         bool in_ellipsis = (macro->is_varg && vec_len(r) + 1 == macro->nargs);
         vec_push(r, read_one_arg(ident, &end, in_ellipsis));
     }
     if (macro->is_varg && vec_len(r) == macro->nargs - 1)
-        vec_push(r, make_vector());
+        vec_push(r, get_vector());
     return r;
 }
 
@@ -199,7 +237,7 @@ static Vector *read_args(Token *tok, Macro *macro) {
         // If a macro M has no parameter, argument list of M()
         // is an empty list. If it has one parameter,
         // argument list of M() is a list containing an empty list.
-        return make_vector();
+        return get_vector();
     }
     Vector *args = do_read_args(tok, macro);
     if (vec_len(args) != macro->nargs)
@@ -207,14 +245,20 @@ static Vector *read_args(Token *tok, Macro *macro) {
     return args;
 }
 
-static Vector *add_hide_set(Vector *tokens, Set *hideset) {
-    Vector *r = make_vector();
+// Adds hideset to the tokens in place.
+static void add_hide_set(Vector *tokens, Set *hideset) {
     for (int i = 0; i < vec_len(tokens); i++) {
-        Token *t = copy_token(vec_get(tokens, i));
-        t->hideset = set_union(t->hideset, hideset);
-        vec_push(r, t);
+        Token *t = vec_get(tokens, i);
+        Set *s = set_union(t->hideset, hideset);
+        // Tokens are shared; copy only the ones whose hideset grows.
+        // Tokens from a macro body never start a line.
+        if (s != t->hideset) {
+            t = copy_token(t);
+            t->hideset = s;
+            t->bol = false;
+            vec_set(tokens, i, t);
+        }
     }
-    return r;
 }
 
 static Token *glue_tokens(Token *t, Token *u) {
@@ -247,22 +291,40 @@ static Token *stringize(Token *tmpl, Vector *args) {
     return r;
 }
 
-static Vector *expand_all(Vector *tokens, Token *tmpl) {
-    token_buffer_stash(vec_reverse(tokens));
-    Vector *r = make_vector();
+// Fully expands the tokens in isolation and appends the result to r.
+static void expand_all(Vector *r, Vector *tokens) {
+    Vector *buf = get_vector();
+    for (int i = vec_len(tokens) - 1; i >= 0; i--)
+        vec_push(buf, vec_get(tokens, i));
+    token_buffer_stash(buf);
     for (;;) {
         Token *tok = read_expand();
         if (tok->kind == TEOF)
             break;
         vec_push(r, tok);
     }
-    propagate_space(r, tmpl);
     token_buffer_unstash();
+    put_vector(buf);
+}
+
+// Returns the fully expanded i-th argument. Arguments are expanded
+// lazily, at most once, because a parameter that is only used with #
+// or ## or not at all doesn't need expansion.
+static Vector *expanded_arg(Vector *args, Vector *expanded, int i) {
+    Vector *r = vec_get(expanded, i);
+    if (!r) {
+        r = get_vector();
+        expand_all(r, vec_get(args, i));
+        vec_set(expanded, i, r);
+    }
     return r;
 }
 
 static Vector *subst(Macro *macro, Vector *args, Set *hideset) {
-    Vector *r = make_vector();
+    Vector *r = get_vector();
+    Vector *expanded = get_vector();
+    for (int i = 0; args && i < vec_len(args); i++)
+        vec_push(expanded, NULL);
     int len = vec_len(macro->body);
     for (int i = 0; i < len; i++) {
         Token *t0 = vec_get(macro->body, i);
@@ -309,13 +371,19 @@ static Vector *subst(Macro *macro, Vector *args, Set *hideset) {
             continue;
         }
         if (t0_param) {
-            Vector *arg = vec_get(args, t0->position);
-            vec_append(r, expand_all(arg, t0));
+            int start = vec_len(r);
+            vec_append(r, expanded_arg(args, expanded, t0->position));
+            propagate_space(r, start, t0);
             continue;
         }
         vec_push(r, t0);
     }
-    return add_hide_set(r, hideset);
+    for (int i = 0; i < vec_len(expanded); i++)
+        if (vec_get(expanded, i))
+            put_vector(vec_get(expanded, i));
+    put_vector(expanded);
+    add_hide_set(r, hideset);
+    return r;
 }
 
 static void unget_all(Vector *tokens) {
@@ -323,6 +391,159 @@ static void unget_all(Vector *tokens) {
         unget_token(vec_get(tokens, i));
 }
 
+/*
+ * Macro expansion memoization
+ *
+ * Constants such as EINVAL or UINT32_MAX are object-like macros used
+ * many times. If the expansion of such a macro involves only other
+ * object-like macros, it is the same on every use, as long as no macro
+ * is defined or undefined in between. We expand it once, in isolation
+ * from the surrounding tokens, and reuse the result.
+ */
+
+// Returns true if the expansion of the macro doesn't depend on where it
+// is used: it doesn't use special macros such as __LINE__, and it never
+// reads tokens following the macro name, which only function-like
+// macros do. A macro using "defined" is not memoizable either, because
+// the operand of "defined" in #if must not be expanded.
+static bool is_memoizable(Macro *macro, Set *hideset) {
+    for (int i = 0; i < vec_len(macro->body); i++) {
+        Token *tok = vec_get(macro->body, i);
+        if (tok->kind != TIDENT || set_has(hideset, tok->sval))
+            continue;
+        if (!strcmp(tok->sval, "defined"))
+            return false;
+        Macro *m = map_get(macros, tok->sval);
+        if (!m)
+            continue;
+        if (m->kind != MACRO_OBJ || !is_memoizable(m, set_add(hideset, tok->sval)))
+            return false;
+    }
+    return true;
+}
+
+static Vector *memoized_expansion(Macro *macro, Token *tok) {
+    if (macro->memo_gen == macro_gen)
+        return macro->memo;
+    Vector *r = NULL;
+    Set *hideset = set_add(NULL, tok->sval);
+    if (is_memoizable(macro, hideset)) {
+        Vector *tokens = subst(macro, NULL, hideset);
+        r = make_vector();
+        expand_all(r, tokens);
+        put_vector(tokens);
+    }
+    macro->memo = r;
+    macro->memo_gen = macro_gen;
+    return r;
+}
+
+/*
+ * Macro report
+ *
+ * -fmacro-report records, for each macro name, how many times it is
+ * expanded, how many tokens the expansions produce and how long they
+ * take, and for each header, how many times it is included and how
+ * many bytes are read from it. The most expensive ones are printed at
+ * exit. The time of a function-like macro includes the time spent
+ * expanding its arguments, so a macro used in the arguments of another
+ * is counted in both.
+ */
+
+bool macro_report = false;
+int macro_report_limit = 20;
+
+typedef struct {
+    char *name;
+    long count;
+    long size;  // tokens produced by a macro, or bytes read from a header
+    long nsec;
+} ReportEntry;
+
+static Map *macro_entries = &EMPTY_MAP;
+static Vector *macro_entry_list = &EMPTY_VECTOR;
+static Map *header_entries = &EMPTY_MAP;
+static Vector *header_entry_list = &EMPTY_VECTOR;
+
+static long now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static ReportEntry *report_entry(Map *map, Vector *list, char *name) {
+    ReportEntry *e = map_get(map, name);
+    if (e)
+        return e;
+    e = calloc(1, sizeof(ReportEntry));
+    e->name = name;
+    map_put(map, name, e);
+    vec_push(list, e);
+    return e;
+}
+
+static void report_expansion(char *name, int ntokens, long start) {
+    ReportEntry *e = report_entry(macro_entries, macro_entry_list, name);
+    e->count++;
+    e->size += ntokens;
+    e->nsec += now_nsec() - start;
+}
+
+static void report_include(char *path, int size) {
+    if (!macro_report)
+        return;
+    ReportEntry *e = report_entry(header_entries, header_entry_list, path);
+    e->count++;
+    e->size += size;
+}
+
+// Sorts by time, then by size, in descending order.
+static int comp_report_entry(const void *p, const void *q) {
+    ReportEntry *x = *(ReportEntry **)p;
+    ReportEntry *y = *(ReportEntry **)q;
+    if (x->nsec != y->nsec)
+        return (x->nsec < y->nsec) ? 1 : -1;
+    if (x->size != y->size)
+        return (x->size < y->size) ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static void sort_report(Vector *list) {
+    qsort(vec_body(list), vec_len(list), sizeof(void *), comp_report_entry);
+}
+
+void print_macro_report() {
+    sort_report(macro_entry_list);
+    long count = 0, ntokens = 0, nsec = 0;
+    for (int i = 0; i < vec_len(macro_entry_list); i++) {
+        ReportEntry *e = vec_get(macro_entry_list, i);
+        count += e->count;
+        ntokens += e->size;
+        nsec += e->nsec;
+    }
+    fprintf(stderr, "macro expansions: %ld (%ld tokens, %ld us)\n", count, ntokens, nsec / 1000);
+    fprintf(stderr, "  %-32s %10s %10s %10s\n", "macro", "expansions", "tokens", "us");
+    for (int i = 0; i < vec_len(macro_entry_list) && i < macro_report_limit; i++) {
+        ReportEntry *e = vec_get(macro_entry_list, i);
+        fprintf(stderr, "  %-32s %10ld %10ld %10ld\n", e->name, e->count, e->size, e->nsec / 1000);
+    }
+
+    sort_report(header_entry_list);
+    count = 0;
+    long nbytes = 0;
+    for (int i = 0; i < vec_len(header_entry_list); i++) {
+        ReportEntry *e = vec_get(header_entry_list, i);
+        count += e->count;
+        nbytes += e->size;
+    }
+    fprintf(stderr, "header includes: %ld (%ld bytes)\n", count, nbytes);
+    fprintf(stderr, "  %-54s %10s %10s\n", "header", "includes", "bytes");
+    for (int i = 0; i < vec_len(header_entry_list) && i < macro_report_limit; i++) {
+        ReportEntry *e = vec_get(header_entry_list, i);
+        fprintf(stderr, "  %-54s %10ld %10ld\n", e->name, e->count, e->size);
+    }
+}
+
 // This is "expand" function in the Dave Prosser's document.
 static Token *read_expand_newline() {
     Token *tok = lex();
@@ -332,13 +553,30 @@ static Token *read_expand_newline() {
     Macro *macro = map_get(macros, name);
     if (!macro || set_has(tok->hideset, name))
         return tok;
+    long start = macro_report ? now_nsec() : 0;
+    macro_expanded = true;
 
     switch (macro->kind) {
     case MACRO_OBJ: {
+        // Tokens from other expansions have their own hidesets,
+        // so only those read from the source use the memo.
+        Vector *memo = tok->hideset ? NULL : memoized_expansion(macro, tok);
+        if (memo) {
+            for (int i = vec_len(memo) - 1; i > 0; i--)
+                unget_token(vec_get(memo, i));
+            if (vec_len(memo) > 0)
+                unget_token(at_position(vec_head(memo), tok));
+            if (macro_report)
+                report_expansion(name, vec_len(memo), start);
+            return read_expand();
+        }
         Set *hideset = set_add(tok->hideset, name);
         Vector *tokens = subst(macro, NULL, hideset);
-        propagate_space(tokens, tok);
+        propagate_position(tokens, tok);
         unget_all(tokens);
+        if (macro_report)
+            report_expansion(name, vec_len(tokens), start);
+        put_vector(tokens);
         return read_expand();
     }
     case MACRO_FUNC: {
@@ -349,12 +587,21 @@ static Token *read_expand_newline() {
         expect(')');
         Set *hideset = set_add(set_intersection(tok->hideset, rparen->hideset), name);
         Vector *tokens = subst(macro, args, hideset);
-        propagate_space(tokens, tok);
+        for (int i = 0; i < vec_len(args); i++)
+            put_vector(vec_get(args, i));
+        put_vector(args);
+        propagate_position(tokens, tok);
         unget_all(tokens);
+        if (macro_report)
+            report_expansion(name, vec_len(tokens), start);
+        put_vector(tokens);
         return read_expand();
     }
     case MACRO_SPECIAL:
         macro->fn(tok);
+        // All but _Pragma expand to a single token.
+        if (macro_report)
+            report_expansion(name, 1, start);
         return read_expand();
     default:
         error("internal error");
@@ -434,6 +681,7 @@ static void read_funclike_macro(Token *name) {
     hashhash_check(body);
     Macro *macro = make_func_macro(body, map_len(param), is_varg);
     map_put(macros, name->sval, macro);
+    macro_gen++;
 }
 
 static void read_obj_macro(char *name) {
@@ -446,6 +694,7 @@ static void read_obj_macro(char *name) {
     }
     hashhash_check(body);
     map_put(macros, name, make_obj_macro(body));
+    macro_gen++;
 }
 
 /*
@@ -471,13 +720,14 @@ static void read_undef() {
     Token *name = read_ident();
     expect_newline();
     map_remove(macros, name->sval);
+    macro_gen++;
 }
 
 /*
  * #if and the like
  */
 
-static Token *read_defined_op() {
+static Token *read_defined_op(char **name) {
     Token *tok = lex();
     if (is_keyword(tok, '(')) {
         tok = lex();
@@ -485,17 +735,25 @@ static Token *read_defined_op() {
     }
     if (tok->kind != TIDENT)
         errort(tok, "identifier expected, but got %s", tok2s(tok));
+    *name = tok->sval;
     return map_get(macros, tok->sval) ? cpp_token_one : cpp_token_zero;
 }
 
+// If the last #if line was "!defined X" or "!defined(X)", this is X.
+static char *negated_defined;
+
 static Vector *read_intexpr_line() {
     Vector *r = make_vector();
+    char *name = NULL;
     for (;;) {
         Token *tok = read_expand_newline();
-        if (tok->kind == TNEWLINE)
+        if (tok->kind == TNEWLINE) {
+            bool negated = (vec_len(r) == 2 && is_keyword(vec_head(r), '!') && name);
+            negated_defined = negated ? name : NULL;
             return r;
+        }
         if (is_ident(tok, "defined")) {
-            vec_push(r, read_defined_op());
+            vec_push(r, read_defined_op(&name));
         } else if (tok->kind == TIDENT) {
             // C11 6.10.1.4 says that remaining identifiers
             // should be replaced with pp-number 0.
@@ -506,14 +764,247 @@ static Vector *read_intexpr_line() {
     }
 }
 
-static bool read_constexpr() {
-    token_buffer_stash(vec_reverse(read_intexpr_line()));
-    Node *expr = read_expr();
-    Token *tok = lex();
-    if (tok->kind != TEOF)
+/*
+ * #if expression evaluator
+ *
+ * C11 6.10.1p4: #if expressions are evaluated in intmax_t or uintmax_t.
+ * This is a precedence-climbing evaluator that works directly on the
+ * macro-expanded tokens of the line, so it allocates nothing and does
+ * not go through the C parser. Subexpressions that are not evaluated
+ * because of &&, || or ?: are parsed with "eval" off, which suppresses
+ * errors such as division by zero.
+ */
+
+static Vector *pp_tokens;
+static int pp_pos;
+static Token *pp_eol;
+
+// Each function returns the value of a subexpression and sets *usig
+// to true if its type is uintmax_t.
+static intmax_t pp_expr(bool eval, bool *usig);
+static intmax_t pp_cond(bool eval, bool *usig);
+
+static Token *pp_peek() {
+    return (pp_pos < vec_len(pp_tokens)) ? vec_get(pp_tokens, pp_pos) : pp_eol;
+}
+
+static Token *pp_next() {
+    Token *tok = pp_peek();
+    if (tok != pp_eol)
+        pp_pos++;
+    return tok;
+}
+
+static void pp_expect(char id) {
+    Token *tok = pp_next();
+    if (!is_keyword(tok, id))
+        errort(tok, "'%c' expected, but got %s", id, tok2s(tok));
+}
+
+static intmax_t pp_number(Token *tok, bool *usig) {
+    char *p = tok->sval;
+    int base = 10;
+    if (!strncasecmp(p, "0x", 2) && isxdigit(p[2])) {
+        base = 16;
+        p += 2;
+    } else if (!strncasecmp(p, "0b", 2) && (p[2] == '0' || p[2] == '1')) {
+        base = 2;
+        p += 2;
+    } else if (*p == '0') {
+        base = 8;
+    }
+    char *end;
+    errno = 0;
+    uintmax_t v = strtoumax(p, &end, base);
+    if (errno == ERANGE)
+        errort(tok, "integer constant is too large: %s", tok->sval);
+    *usig = false;
+    for (; *end; end++) {
+        if (*end == 'u' || *end == 'U')
+            *usig = true;
+        else if (*end != 'l' && *end != 'L')
+            errort(tok, "invalid integer constant in #if: %s", tok->sval);
+    }
+    // C11 6.4.4.1p5: An octal or hexadecimal constant that does not fit
+    // in intmax_t is unsigned.
+    if (v > INTMAX_MAX && base != 10)
+        *usig = true;
+    return v;
+}
+
+static intmax_t pp_primary(bool eval, bool *usig) {
+    Token *tok = pp_next();
+    if (is_keyword(tok, '(')) {
+        intmax_t r = pp_expr(eval, usig);
+        pp_expect(')');
+        return r;
+    }
+    switch (tok->kind) {
+    case TNUMBER:
+        return pp_number(tok, usig);
+    case TCHAR:
+        *usig = false;
+        return tok->c;
+    case TSTRING:
+        errort(tok, "string literal is not allowed in #if");
+    case TEOF:
+        errort(tok, "premature end of #if expression");
+    default:
+        errort(tok, "invalid token in #if: %s", tok2s(tok));
+    }
+}
+
+static intmax_t pp_unary(bool eval, bool *usig) {
+    Token *tok = pp_peek();
+    if (tok->kind != TKEYWORD)
+        return pp_primary(eval, usig);
+    switch (tok->id) {
+    case '+':
+        pp_next();
+        return pp_unary(eval, usig);
+    case '-':
+        pp_next();
+        return -(uintmax_t)pp_unary(eval, usig);
+    case '~':
+        pp_next();
+        return ~pp_unary(eval, usig);
+    case '!': {
+        pp_next();
+        intmax_t v = pp_unary(eval, usig);
+        *usig = false;
+        return !v;
+    }
+    default:
+        return pp_primary(eval, usig);
+    }
+}
+
+static int pp_prec(Token *tok) {
+    if (tok->kind != TKEYWORD)
+        return -1;
+    switch (tok->id) {
+    case '*': case '/': case '%': return 10;
+    case '+': case '-':           return 9;
+    case OP_SAL: case OP_SAR:     return 8;
+    case '<': case '>': case OP_LE: case OP_GE: return 7;
+    case OP_EQ: case OP_NE:       return 6;
+    case '&':                     return 5;
+    case '^':                     return 4;
+    case '|':                     return 3;
+    case OP_LOGAND:               return 2;
+    case OP_LOGOR:                return 1;
+    default:                      return -1;
+    }
+}
+
+static intmax_t pp_shift(int op, intmax_t l, bool usig, intmax_t n) {
+    if (n < 0 || n >= 64)
+        return (op == OP_SAR && !usig && l < 0) ? -1 : 0;
+    if (op == OP_SAL)
+        return (uintmax_t)l << n;
+    return usig ? (intmax_t)((uintmax_t)l >> n) : l >> n;
+}
+
+// Applies a binary operator. On entry *usig is the signedness of the
+// left operand; rusig is that of the right one.
+static intmax_t pp_binop(Token *tok, intmax_t l, intmax_t r, bool *usig, bool rusig, bool eval) {
+    int op = tok->id;
+    if (op == OP_SAL || op == OP_SAR)
+        return pp_shift(op, l, *usig, r);
+    // Usual arithmetic conversions: unsigned wins.
+    bool u = *usig || rusig;
+    uintmax_t ul = l, ur = r;
+    *usig = u;
+    switch (op) {
+    case '*': return ul * ur;
+    case '+': return ul + ur;
+    case '-': return ul - ur;
+    case '&': return ul & ur;
+    case '^': return ul ^ ur;
+    case '|': return ul | ur;
+    case '/': case '%':
+        if (r == 0) {
+            if (eval)
+                errort(tok, "division by zero in #if");
+            return 0;
+        }
+        if (u)
+            return (op == '/') ? ul / ur : ul % ur;
+        if (l == INTMAX_MIN && r == -1)
+            return (op == '/') ? l : 0;
+        return (op == '/') ? l / r : l % r;
+    }
+    // Comparisons have type int.
+    *usig = false;
+    switch (op) {
+    case '<':   return u ? ul < ur : l < r;
+    case '>':   return u ? ul > ur : l > r;
+    case OP_LE: return u ? ul <= ur : l <= r;
+    case OP_GE: return u ? ul >= ur : l >= r;
+    case OP_EQ: return ul == ur;
+    case OP_NE: return ul != ur;
+    }
+    error("internal error");
+}
+
+static intmax_t pp_binary(int minprec, bool eval, bool *usig) {
+    intmax_t l = pp_unary(eval, usig);
+    for (;;) {
+        Token *tok = pp_peek();
+        int prec = pp_prec(tok);
+        if (prec < minprec)
+            return l;
+        pp_next();
+        bool rusig;
+        if (tok->id == OP_LOGAND) {
+            intmax_t r = pp_binary(prec + 1, eval && l, &rusig);
+            l = l && r;
+            *usig = false;
+        } else if (tok->id == OP_LOGOR) {
+            intmax_t r = pp_binary(prec + 1, eval && !l, &rusig);
+            l = l || r;
+            *usig = false;
+        } else {
+            intmax_t r = pp_binary(prec + 1, eval, &rusig);
+            l = pp_binop(tok, l, r, usig, rusig, eval);
+        }
+    }
+}
+
+static intmax_t pp_cond(bool eval, bool *usig) {
+    intmax_t c = pp_binary(1, eval, usig);
+    if (!is_keyword(pp_peek(), '?'))
+        return c;
+    pp_next();
+    bool usig1, usig2;
+    intmax_t then = pp_expr(eval && c, &usig1);
+    pp_expect(':');
+    intmax_t els = pp_cond(eval && !c, &usig2);
+    *usig = usig1 || usig2;
+    return c ? then : els;
+}
+
+static intmax_t pp_expr(bool eval, bool *usig) {
+    intmax_t r = pp_cond(eval, usig);
+    while (is_keyword(pp_peek(), ',')) {
+        pp_next();
+        r = pp_cond(eval, usig);
+    }
+    return r;
+}
+
+static bool read_constexpr(Token *hash) {
+    pp_tokens = read_intexpr_line();
+    pp_pos = 0;
+    pp_eol = &(Token){ TEOF, .file = hash->file, .line = hash->line, .column = hash->column };
+    if (vec_len(pp_tokens) == 0)
+        errort(hash, "no expression in #if");
+    bool usig;
+    intmax_t r = pp_expr(true, &usig);
+    Token *tok = pp_peek();
+    if (tok != pp_eol)
         errort(tok, "stray token: %s", tok2s(tok));
-    token_buffer_unstash();
-    return eval_intexpr(expr, NULL);
+    return r != 0;
 }
 
 static void do_read_if(bool istrue) {
@@ -522,8 +1013,15 @@ static void do_read_if(bool istrue) {
         skip_cond_incl();
 }
 
-static void read_if() {
-    do_read_if(read_constexpr());
+static void read_if(Token *hash) {
+    do_read_if(read_constexpr(hash));
+    if (hash->count == 0 && negated_defined) {
+        // "#if !defined(X)" at the beginning of a file.
+        // Prepare to detect an include guard.
+        CondIncl *ci = vec_tail(cond_incl_stack);
+        ci->include_guard = negated_defined;
+        ci->file = hash->file;
+    }
 }
 
 static void read_ifdef() {
@@ -570,7 +1068,7 @@ static void read_elif(Token *hash) {
         errort(hash, "#elif after #else");
     ci->ctx = IN_ELIF;
     ci->include_guard = NULL;
-    if (ci->wastrue || !read_constexpr()) {
+    if (ci->wastrue || !read_constexpr(hash)) {
         skip_cond_incl();
         return;
     }
@@ -599,7 +1097,7 @@ static void read_endif(Token *hash) {
         return;
     Token *last = skip_newlines();
     if (ci->file != last->file)
-        map_put(include_guard, ci->file->name, ci->include_guard);
+        map_put(include_guard, file_id(ci->file->name), ci->include_guard);
 }
 
 /*
@@ -668,25 +1166,152 @@ static char *read_cpp_header_name(Token *hash, bool *std) {
     return join_paths(tokens);
 }
 
-static bool guarded(char *path) {
-    char *guard = map_get(include_guard, path);
+static bool guarded(char *id) {
+    static Macro *zero, *one;
+    if (!zero) {
+        zero = make_obj_macro(make_vector1(cpp_token_zero));
+        one = make_obj_macro(make_vector1(cpp_token_one));
+    }
+    char *guard = map_get(include_guard, id);
     bool r = (guard && map_get(macros, guard));
-    define_obj_macro("__8cc_include_guard", r ? cpp_token_one : cpp_token_zero);
+    Macro *m = r ? one : zero;
+    if (map_get(macros, "__8cc_include_guard") != m) {
+        map_put(macros, "__8cc_include_guard", m);
+        macro_gen++;
+    }
     return r;
 }
 
-static bool try_include(char *dir, char *filename, bool isimport) {
-    char *path = fullpath(format("%s/%s", dir, filename));
-    if (map_get(once, path))
-        return true;
-    if (guarded(path))
+/*
+ * Include path lookup cache
+ *
+ * Finding a header means trying each directory of the include path in
+ * turn, and most of the attempts fail. The outcome of each attempt,
+ * including failed ones, is remembered for the life of the process,
+ * so a (directory, file name) pair is looked up in the file system
+ * at most once. The same stat() call gives the file's ID, which keys
+ * #pragma once and include guards.
+ */
+
+bool include_stats = false;
+static Map *include_cache = &EMPTY_MAP;
+static Map *file_ids = &EMPTY_MAP;
+static char *include_not_found = "";
+static int include_hits, include_misses, include_negative_hits, include_negative_misses;
+static int include_opens, include_skips;
+
+// A file ID is made of the device and inode numbers, so that a file
+// reached through different paths, such as symbolic links, has one ID.
+static char *make_file_id(struct stat *st) {
+    return format("%lx:%lx", (unsigned long)st->st_dev, (unsigned long)st->st_ino);
+}
+
+static char *file_id(char *path) {
+    char *id = map_get(file_ids, path);
+    if (id)
+        return id;
+    struct stat st;
+    id = (stat(path, &st) == -1) ? path : make_file_id(&st);
+    map_put(file_ids, path, id);
+    return id;
+}
+
+// Returns the full path of the file if it exists, or NULL otherwise.
+static char *lookup_include(char *dir, char *filename) {
+    char *key = format("%s/%s", dir, filename);
+    char *path = map_get(include_cache, key);
+    if (path) {
+        include_hits++;
+        if (path == include_not_found) {
+            include_negative_hits++;
+            return NULL;
+        }
+        return path;
+    }
+    include_misses++;
+    path = fullpath(key);
+    struct stat st;
+    if (stat(path, &st) == -1 || S_ISDIR(st.st_mode)) {
+        include_negative_misses++;
+        path = include_not_found;
+    } else {
+        map_put(file_ids, path, make_file_id(&st));
+    }
+    map_put(include_cache, key, path);
+    return (path == include_not_found) ? NULL : path;
+}
+
+void print_include_stats() {
+    fprintf(stderr, "include lookups: %d\n", include_hits + include_misses);
+    fprintf(stderr, "  cache hits:    %d (%d not found)\n", include_hits, include_negative_hits);
+    fprintf(stderr, "  cache misses:  %d (%d not found)\n", include_misses, include_negative_misses);
+    fprintf(stderr, "files opened:    %d\n", include_opens);
+    fprintf(stderr, "files skipped:   %d\n", include_skips);
+}
+
+/*
+ * Header dependencies
+ *
+ * Every header found by #include is recorded so that the driver can
+ * write a Makefile rule for the input file (-M and friends). Headers
+ * found in the built-in include directories, and headers included from
+ * them, are system headers, which -MM leaves out.
+ */
+
+static Vector *dep_paths = &EMPTY_VECTOR;   // full paths in the order found
+static Map *dep_names = &EMPTY_MAP;         // full path -> path as written
+static Map *system_headers = &EMPTY_MAP;    // full path -> (void *)1
+static int nuser_include_path;              // the number of -I directories
+
+static void add_dependency(char *dir, char *filename, char *path, bool system) {
+    if (system)
+        map_put(system_headers, path, (void *)1);
+    if (map_get(dep_names, path))
+        return;
+    char *name = (filename[0] == '/') ? filename : format("%s/%s", dir, filename);
+    if (!strncmp(name, "./", 2))
+        name += 2;
+    vec_push(dep_paths, path);
+    map_put(dep_names, path, name);
+}
+
+Vector *header_dependencies(bool system) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(dep_paths); i++) {
+        char *path = vec_get(dep_paths, i);
+        if (system || !map_get(system_headers, path))
+            vec_push(r, map_get(dep_names, path));
+    }
+    return r;
+}
+
+// Includes dir/filename if exists. "from" is the file containing the
+// directive, and "system" tells if dir is a system include directory.
+static bool try_include(File *from, char *dir, char *filename, bool isimport, bool system) {
+    char *path = lookup_include(dir, filename);
+    if (!path)
+        return false;
+    // The compiler's own startup header, read from a string, is not a
+    // dependency of the input.
+    if (from->name)
+        add_dependency(dir, filename, path, system || map_get(system_headers, from->name));
+    // Including a file that has #pragma once or whose include guard
+    // macro is defined is a no-op, so don't open it.
+    char *id = file_id(path);
+    if (map_get(once, id) || guarded(id)) {
+        include_skips++;
+        report_include(path, 0);
         return true;
+    }
     FILE *fp = fopen(path, "r");
     if (!fp)
         return false;
+    include_opens++;
     if (isimport)
-        map_put(once, path, (void *)1);
-    stream_push(make_file(fp, path));
+        map_put(once, id, (void *)1);
+    File *f = make_file(fp, path);
+    report_include(path, f->size);
+    stream_push(f);
     return true;
 }
 
@@ -695,17 +1320,24 @@ static void read_include(Token *hash, File *file, bool isimport) {
     char *filename = read_cpp_header_name(hash, &std);
     expect_newline();
     if (filename[0] == '/') {
-        if (try_include("/", filename, isimport))
+        if (try_include(file, "/", filename, isimport, false))
             return;
         goto err;
     }
     if (!std) {
-        char *dir = file->name ? dirname(strdup(file->name)) : ".";
-        if (try_include(dir, filename, isimport))
+        // Search the directory of the current file, using the file's
+        // name as it was found so that dependencies are listed with
+        // relative paths where possible.
+        char *name = file->name ? map_get(dep_names, file->name) : NULL;
+        if (!name)
+            name = file->name;
+        char *dir = name ? dirname(strdup(name)) : ".";
+        if (try_include(file, dir, filename, isimport, false))
             return;
     }
     for (int i = 0; i < vec_len(std_include_path); i++)
-        if (try_include(vec_get(std_include_path, i), filename, isimport))
+        if (try_include(file, vec_get(std_include_path, i), filename, isimport,
+                        i >= nuser_include_path))
             return;
   err:
     errort(hash, "cannot find header file: %s", filename);
@@ -720,19 +1352,20 @@ static void read_include_next(Token *hash, File *file) {
     char *filename = read_cpp_header_name(hash, &std);
     expect_newline();
     if (filename[0] == '/') {
-        if (try_include("/", filename, false))
+        if (try_include(file, "/", filename, false, false))
             return;
         goto err;
     }
     char *cur = fullpath(file->name);
     int i = 0;
     for (; i < vec_len(std_include_path); i++) {
-        char *dir = vec_get(std_include_path, i);
-        if (!strcmp(cur, fullpath(format("%s/%s", dir, filename))))
+        char *path = lookup_include(vec_get(std_include_path, i), filename);
+        if (path && !strcmp(cur, path))
             break;
     }
     for (i++; i < vec_len(std_include_path); i++)
-        if (try_include(vec_get(std_include_path, i), filename, false))
+        if (try_include(file, vec_get(std_include_path, i), filename, false,
+                        i >= nuser_include_path))
             return;
   err:
     errort(hash, "cannot find header file: %s", filename);
@@ -745,8 +1378,7 @@ static void read_include_next(Token *hash, File *file) {
 static void parse_pragma_operand(Token *tok) {
     char *s = tok->sval;
     if (!strcmp(s, "once")) {
-        char *path = fullpath(tok->file->name);
-        map_put(once, path, (void *)1);
+        map_put(once, file_id(tok->file->name), (void *)1);
     } else if (!strcmp(s, "enable_warning")) {
         enable_warning = true;
     } else if (!strcmp(s, "disable_warning")) {
@@ -829,7 +1461,7 @@ static void read_directive(Token *hash) {
     else if (!strcmp(s, "else"))         read_else(hash);
     else if (!strcmp(s, "endif"))        read_endif(hash);
     else if (!strcmp(s, "error"))        read_error(hash);
-    else if (!strcmp(s, "if"))           read_if();
+    else if (!strcmp(s, "if"))           read_if(hash);
     else if (!strcmp(s, "ifdef"))        read_ifdef();
     else if (!strcmp(s, "ifndef"))       read_ifndef();
     else if (!strcmp(s, "import"))       read_include(hash, tok->file, true);
@@ -856,6 +1488,7 @@ static void make_token_pushback(Token *tmpl, int kind, char *sval) {
     tok->sval = sval;
     tok->slen = strlen(sval) + 1;
     tok->enc = ENC_NONE;
+    tok->hideset = set_add(tmpl->hideset, tmpl->sval);
     unget_token(tok);
 }
 
@@ -902,7 +1535,6 @@ static void handle_base_file_macro(Token *tmpl) {
 }
 
 static void handle_counter_macro(Token *tmpl) {
-    static int counter = 0;
     make_token_pushback(tmpl, TNUMBER, format("%d", counter++));
 }
 
@@ -918,10 +1550,6 @@ void add_include_path(char *path) {
     vec_push(std_include_path, path);
 }
 
-static void define_obj_macro(char *name, Token *value) {
-    map_put(macros, name, make_obj_macro(make_vector1(value)));
-}
-
 static void define_special_macro(char *name, SpecialMacroHandler *fn) {
     map_put(macros, name, make_special_macro(fn));
 }
@@ -935,6 +1563,7 @@ static void init_keywords() {
 }
 
 static void init_predefined_macros() {
+    nuser_include_path = vec_len(std_include_path);
     vec_push(std_include_path, BUILD_DIR "/include");
     vec_push(std_include_path, "/usr/local/lib/8cc/include");
     vec_push(std_include_path, "/usr/local/include");
@@ -952,8 +1581,6 @@ static void init_predefined_macros() {
     define_special_macro("__COUNTER__", handle_counter_macro);
     define_special_macro("__INCLUDE_LEVEL__", handle_include_level_macro);
     define_special_macro("__TIMESTAMP__", handle_timestamp_macro);
-
-    read_from_string("#include <" BUILD_DIR "/include/8cc.h>");
 }
 
 void init_now() {
@@ -961,11 +1588,329 @@ void init_now() {
     localtime_r(&timet, &now);
 }
 
-void cpp_init() {
+static void do_cpp_init(void (*read)(char *buf)) {
     setlocale(LC_ALL, "C");
     init_keywords();
     init_now();
     init_predefined_macros();
+    read("#include <" BUILD_DIR "/include/8cc.h>");
+}
+
+void cpp_init() {
+    do_cpp_init(read_from_string);
+}
+
+// Initializes the preprocessor for use without the parser. The startup
+// header is read only for its macro definitions.
+void cpp_init_standalone() {
+    do_cpp_init(cpp_read_from_string);
+}
+
+/*
+ * Saving state
+ *
+ * The state of a translation unit can be set aside while another one is
+ * preprocessed, which is what libcpp.c does. Keywords, the include path
+ * lookup cache and file IDs are shared, since they don't depend on the
+ * input.
+ */
+
+typedef struct {
+    Map *macros;
+    Map *once;
+    Map *include_guard;
+    Vector *cond_incl_stack;
+    Vector *std_include_path;
+    int nuser_include_path;
+    int counter;
+    Vector *dep_paths;
+    Map *dep_names;
+    Map *system_headers;
+} CppState;
+
+// Returns the state of the current translation unit and resets it, so
+// that another one can be started. cpp_restore() switches back.
+void *cpp_save() {
+    CppState *r = malloc(sizeof(CppState));
+    *r = (CppState){ macros, once, include_guard, cond_incl_stack, std_include_path,
+                     nuser_include_path, counter, dep_paths, dep_names, system_headers };
+    macros = make_map();
+    once = make_map();
+    include_guard = make_map();
+    cond_incl_stack = make_vector();
+    std_include_path = make_vector();
+    nuser_include_path = 0;
+    counter = 0;
+    dep_paths = make_vector();
+    dep_names = make_map();
+    system_headers = make_map();
+    macro_gen++;
+    return r;
+}
+
+void cpp_restore(void *state) {
+    CppState *s = state;
+    macros = s->macros;
+    once = s->once;
+    include_guard = s->include_guard;
+    cond_incl_stack = s->cond_incl_stack;
+    std_include_path = s->std_include_path;
+    nuser_include_path = s->nuser_include_path;
+    counter = s->counter;
+    dep_paths = s->dep_paths;
+    dep_names = s->dep_names;
+    system_headers = s->system_headers;
+    macro_gen++;
+}
+
+/*
+ * Preprocessed output
+ *
+ * -E output is written through a large buffer, copying token spellings
+ * without formatting them first. Tokens keep their line structure:
+ * short gaps are filled with newlines and anything else is marked with
+ * a GNU-style line marker, "# <line> "<file>" <flags>", where flag 1
+ * means entering a header, 2 returning to a file and 3 a system header.
+ * The output can be fed back to the compiler.
+ */
+
+bool linemarkers = true;
+static FILE *out_fp;
+static char out_buf[65536];
+static int out_len;
+static File *out_file;              // file of the current output line
+static char *out_name;              // its name as last printed
+static int out_line;                // line number of the current output line
+static bool out_bol = true;         // at the beginning of an output line
+static Vector *out_stack = &EMPTY_VECTOR; // files being included
+
+static void out_flush() {
+    fwrite(out_buf, 1, out_len, out_fp);
+    out_len = 0;
+}
+
+static void out_write(char *s, int len) {
+    if (out_len + len > sizeof(out_buf)) {
+        out_flush();
+        if (len > sizeof(out_buf)) {
+            fwrite(s, 1, len, out_fp);
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, s, len);
+    out_len += len;
+}
+
+static void out_str(char *s) {
+    out_write(s, strlen(s));
+}
+
+static void out_char(char c) {
+    if (out_len == sizeof(out_buf))
+        out_flush();
+    out_buf[out_len++] = c;
+}
+
+static void out_newline() {
+    out_char('\n');
+    out_bol = true;
+}
+
+// Writes a character of a string or character literal. Octal escapes
+// have at most three digits, so they cannot run into what follows.
+static void out_quoted(int c, char quote) {
+    if (c == quote || c == '\\') {
+        out_char('\\');
+        out_char(c);
+    } else if (c == '\n') {
+        out_str("\\n");
+    } else if ((0 <= c && c < ' ') || c == 0x7f) {
+        char buf[5];
+        snprintf(buf, sizeof(buf), "\\%03o", c);
+        out_str(buf);
+    } else {
+        out_char(c);
+    }
+}
+
+// Returns the spelling of a keyword or of a punctuator made of more
+// than one character.
+static char *keyword_spelling(int id) {
+    switch (id) {
+#define op(id, str)         case id: return str;
+#define keyword(id, str, _) case id: return str;
+#include "keyword.inc"
+#undef keyword
+#undef op
+    }
+    return NULL;
+}
+
+static void out_spelling(Token *tok) {
+    switch (tok->kind) {
+    case TIDENT:
+    case TNUMBER:
+        out_str(tok->sval);
+        return;
+    case TKEYWORD: {
+        char *s = keyword_spelling(tok->id);
+        if (s)
+            out_str(s);
+        else
+            out_char(tok->id);
+        return;
+    }
+    case TCHAR:
+        out_str(encoding_prefix(tok->enc));
+        out_char('\'');
+        if (tok->enc == ENC_NONE)
+            out_quoted((unsigned char)tok->c, '\'');
+        else if (tok->c < 0x80)
+            out_quoted(tok->c, '\'');
+        else {
+            char buf[11];
+            snprintf(buf, sizeof(buf), "\\U%08x", tok->c);
+            out_str(buf);
+        }
+        out_char('\'');
+        return;
+    case TSTRING:
+        // Bytes above 0x7f are written as they are so that UTF-8 text
+        // stays readable; the lexer reads them back unchanged.
+        out_str(encoding_prefix(tok->enc));
+        out_char('"');
+        for (int i = 0; i < tok->slen - 1; i++)
+            out_quoted((unsigned char)tok->sval[i], '"');
+        out_char('"');
+        return;
+    case TINVALID:
+        out_char(tok->c);
+        return;
+    }
+    error("internal error: unknown token kind: %d", tok->kind);
+}
+
+static bool is_word_char(char c) {
+    return isalnum(c) || c == '_' || c == '.' || (c & 0x80);
+}
+
+// Returns true if writing tok right after the last character of output
+// could make a different token, as in "+" followed by "+".
+static bool would_paste(Token *tok) {
+    if (out_len == 0)
+        return false;
+    char last = out_buf[out_len - 1];
+    char c;
+    if (tok->kind == TIDENT || tok->kind == TNUMBER)
+        c = tok->sval[0];
+    else if (tok->kind == TKEYWORD)
+        c = keyword_spelling(tok->id) ? keyword_spelling(tok->id)[0] : tok->id;
+    else if (tok->kind == TCHAR || tok->kind == TSTRING)
+        return is_word_char(last);
+    else
+        c = tok->c;
+    if (is_word_char(last))
+        return is_word_char(c);
+    return strchr("+-*/%<>=!&|^#.:", last) && strchr("+-*/%<>=!&|^#.:", c);
+}
+
+static void out_linemarker(int flag) {
+    if (!out_bol)
+        out_newline();
+    if (!linemarkers)
+        return;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "# %d \"", out_line);
+    out_str(buf);
+    for (char *p = out_name; *p; p++)
+        out_quoted((unsigned char)*p, '"');
+    out_char('"');
+    if (flag) {
+        snprintf(buf, sizeof(buf), " %d", flag);
+        out_str(buf);
+    }
+    if (flag && map_get(system_headers, out_file->name))
+        out_str(" 3");
+    out_newline();
+}
+
+// Moves the output to the line of the given token.
+static void out_move_to(Token *tok) {
+    File *file = tok->file;
+    if (file != out_file) {
+        // Leave the headers that have been finished.
+        while (vec_len(out_stack) > 0 && ((File *)vec_tail(out_stack))->depth > file->depth)
+            vec_pop(out_stack);
+        int flag;
+        if (vec_len(out_stack) > 0 && vec_tail(out_stack) == file) {
+            flag = 2;
+        } else {
+            if (vec_len(out_stack) > 0 && ((File *)vec_tail(out_stack))->depth == file->depth)
+                vec_pop(out_stack);
+            flag = vec_len(out_stack) ? 1 : 0;
+            vec_push(out_stack, file);
+        }
+        out_file = file;
+        out_name = file->name;
+        out_line = tok->line;
+        out_linemarker(flag);
+        return;
+    }
+    if (out_name != file->name && strcmp(out_name, file->name)) {
+        // The name was changed by #line.
+        out_name = file->name;
+        out_line = tok->line;
+        out_linemarker(0);
+        return;
+    }
+    if (tok->line < out_line || tok->line - out_line > 8) {
+        out_line = tok->line;
+        out_linemarker(0);
+        return;
+    }
+    if (tok->line == out_line) {
+        if (!out_bol)
+            out_char(' ');
+        return;
+    }
+    for (; out_line < tok->line; out_line++)
+        out_newline();
+}
+
+// Preprocesses the input and writes the result to fp.
+void write_preprocessed(FILE *fp) {
+    out_fp = fp;
+    File *file = current_file();
+    if (file->name) {
+        vec_push(out_stack, file);
+        out_file = file;
+        out_name = file->name;
+        out_line = 1;
+        out_linemarker(0);
+    }
+    macro_expanded = false;
+    for (;;) {
+        Token *tok = read_cpp_token();
+        if (tok->kind == TEOF)
+            break;
+        // Tokens adjacent in the source are lexed the same way again,
+        // so pasting is only a concern if the last token came from a
+        // macro, or a macro was expanded since, even to nothing.
+        if (tok->bol && tok->file && tok->file->name) {
+            out_move_to(tok);
+            // Keep the indentation.
+            for (int i = 1; out_bol && i < tok->column; i++)
+                out_char(' ');
+        } else if (!out_bol && (tok->space || (macro_expanded && would_paste(tok)))) {
+            out_char(' ');
+        }
+        out_spelling(tok);
+        out_bol = false;
+        macro_expanded = (tok->hideset != NULL);
+    }
+    if (!out_bol)
+        out_newline();
+    out_flush();
 }
 
 /*
@@ -994,21 +1939,32 @@ void read_from_string(char *buf) {
     stream_unstash();
 }
 
+// Reads the directives in buf, discarding any other tokens.
+void cpp_read_from_string(char *buf) {
+    stream_stash(make_file_string(buf));
+    while (read_token()->kind != TEOF)
+        ;
+    stream_unstash();
+}
+
 Token *peek_token() {
     Token *r = read_token();
     unget_token(r);
     return r;
 }
 
-Token *read_token() {
-    Token *tok;
+static Token *read_cpp_token() {
     for (;;) {
-        tok = read_expand();
+        Token *tok = read_expand();
         if (tok->bol && is_keyword(tok, '#') && tok->hideset == NULL) {
             read_directive(tok);
             continue;
         }
         assert(tok->kind < MIN_CPP_TOKEN);
-        return maybe_convert_keyword(tok);
+        return tok;
     }
 }
+
+Token *read_token() {
+    return maybe_convert_keyword(read_cpp_token());
+}
@@ -268,7 +268,7 @@ char *node2s(Node *node) {
     return buf_body(b);
 }
 
-static char *encoding_prefix(int enc) {
+char *encoding_prefix(int enc) {
     switch (enc) {
     case ENC_CHAR16: return "u";
     case ENC_CHAR32: return "U";
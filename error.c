@@ -1,5 +1,6 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +9,17 @@
 bool enable_warning = true;
 bool warning_is_error = false;
 
+// If set, an error jumps here instead of terminating the process,
+// leaving the message in error_message. Used by libcpp.c.
+jmp_buf *error_jmp;
+char *error_message;
+
+static noreturn void recover(char *pos, char *fmt, va_list args) {
+    char *msg = vformat(fmt, args);
+    error_message = pos ? format("%s: %s", pos, msg) : msg;
+    longjmp(*error_jmp, 1);
+}
+
 static void print_error(char *line, char *pos, char *label, char *fmt, va_list args) {
     fprintf(stderr, isatty(fileno(stderr)) ? "\e[1;31m[%s]\e[0m " : "[%s] ", label);
     fprintf(stderr, "%s: %s: ", line, pos);
@@ -18,6 +30,8 @@ static void print_error(char *line, char *pos, char *label, char *fmt, va_list a
 void errorf(char *line, char *pos, char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
+    if (error_jmp)
+        recover(pos, fmt, args);
     print_error(line, pos, "ERROR", fmt, args);
     va_end(args);
     exit(1);
@@ -29,6 +43,8 @@ void warnf(char *line, char *pos, char *fmt, ...) {
     char *label = warning_is_error ? "ERROR" : "WARN";
     va_list args;
     va_start(args, fmt);
+    if (warning_is_error && error_jmp)
+        recover(pos, fmt, args);
     print_error(line, pos, label, fmt, args);
     va_end(args);
     if (warning_is_error)
@@ -2,8 +2,9 @@
 
 /*
  * This file provides character input stream for C source code.
- * An input stream is either backed by stdio's FILE * or
- * backed by a string.
+ * An input stream is backed by a string. Files are read into memory
+ * in one go when they are opened, and the contents are kept around
+ * so that the code generator can print source lines (see below).
  * The following input processing is done at this stage.
  *
  * - C11 5.1.1.2p1: "\r\n" or "\r" are canonicalized to "\n".
@@ -26,10 +27,49 @@
 
 static Vector *files = &EMPTY_VECTOR;
 static Vector *stashed = &EMPTY_VECTOR;
+static Map *sources = &EMPTY_MAP;
+
+static char *read_whole_file(FILE *file, int *len) {
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1)
+        error("fstat failed: %s", strerror(errno));
+    int nalloc = S_ISREG(st.st_mode) ? st.st_size + 1 : 4096;
+    char *buf = malloc(nalloc);
+    int n = 0;
+    for (;;) {
+        if (n == nalloc - 1) {
+            nalloc *= 2;
+            buf = realloc(buf, nalloc);
+        }
+        int nread = fread(buf + n, 1, nalloc - 1 - n, file);
+        if (nread == 0)
+            break;
+        n += nread;
+    }
+    if (ferror(file))
+        error("read failed: %s", strerror(errno));
+    // Canonicalize "\r\n" and "\r" here so that code scanning the
+    // buffer directly only needs to look for "\n".
+    if (memchr(buf, '\r', n)) {
+        char *q = buf;
+        for (int i = 0; i < n; i++) {
+            if (buf[i] != '\r') {
+                *q++ = buf[i];
+                continue;
+            }
+            *q++ = '\n';
+            if (i + 1 < n && buf[i + 1] == '\n')
+                i++;
+        }
+        n = q - buf;
+    }
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
 
 File *make_file(FILE *file, char *name) {
     File *r = calloc(1, sizeof(File));
-    r->file = file;
     r->name = name;
     r->line = 1;
     r->column = 1;
@@ -37,6 +77,10 @@ File *make_file(FILE *file, char *name) {
     if (fstat(fileno(file), &st) == -1)
         error("fstat failed: %s", strerror(errno));
     r->mtime = st.st_mtime;
+    r->data = read_whole_file(file, &r->size);
+    r->p = r->data;
+    fclose(file);
+    map_put(sources, name, r);
     return r;
 }
 
@@ -48,25 +92,6 @@ File *make_file_string(char *s) {
     return r;
 }
 
-static void close_file(File *f) {
-    if (f->file)
-        fclose(f->file);
-}
-
-static int readc_file(File *f) {
-    int c = getc(f->file);
-    if (c == EOF) {
-        c = (f->last == '\n' || f->last == EOF) ? EOF : '\n';
-    } else if (c == '\r') {
-        int c2 = getc(f->file);
-        if (c2 != '\n')
-            ungetc(c2, f->file);
-        c = '\n';
-    }
-    f->last = c;
-    return c;
-}
-
 static int readc_string(File *f) {
     int c;
     if (*f->p == '\0') {
@@ -77,7 +102,7 @@ static int readc_string(File *f) {
             f->p++;
         c = '\n';
     } else {
-        c = *f->p++;
+        c = (unsigned char)*f->p++;
     }
     f->last = c;
     return c;
@@ -88,8 +113,6 @@ static int get() {
     int c;
     if (f->buflen > 0) {
         c = f->buf[--f->buflen];
-    } else if (f->file) {
-        c = readc_file(f);
     } else {
         c = readc_string(f);
     }
@@ -108,7 +131,7 @@ int readc() {
         if (c == EOF) {
             if (vec_len(files) == 1)
                 return c;
-            close_file(vec_pop(files));
+            vec_pop(files);
             continue;
         }
         if (c != '\\')
@@ -140,6 +163,7 @@ File *current_file() {
 }
 
 void stream_push(File *f) {
+    f->depth = vec_len(files);
     vec_push(files, f);
 }
 
@@ -162,3 +186,78 @@ void stream_stash(File *f) {
 void stream_unstash() {
     files = vec_pop(stashed);
 }
+
+typedef struct {
+    Vector *files;
+    Vector *stashed;
+} StreamState;
+
+// Returns the files being read and resets the stream, so that another
+// input can be read. stream_restore() switches back.
+void *stream_save() {
+    StreamState *r = malloc(sizeof(StreamState));
+    r->files = files;
+    r->stashed = stashed;
+    files = make_vector();
+    stashed = make_vector();
+    return r;
+}
+
+void stream_restore(void *state) {
+    StreamState *s = state;
+    files = s->files;
+    stashed = s->stashed;
+}
+
+/*
+ * Source line index
+ *
+ * Maps a line number to the start of the line in a file's buffer.
+ * The index is built on first use. Files that were not read by the
+ * lexer (e.g. names given by #line) are read from disk here.
+ */
+
+static void build_line_index(File *f) {
+    int n = 1;
+    for (char *p = f->data; *p; p++)
+        if (*p == '\n' || (*p == '\r' && p[1] != '\n'))
+            n++;
+    f->lines = malloc(sizeof(int) * (n + 1));
+    f->nlines = 0;
+    f->lines[f->nlines++] = 0;
+    for (char *p = f->data; *p; p++)
+        if (*p == '\n' || (*p == '\r' && p[1] != '\n'))
+            f->lines[f->nlines++] = p + 1 - f->data;
+    f->lines[f->nlines] = f->size + 1;
+}
+
+static File *get_source(char *name) {
+    static File unreadable;
+    File *f = map_get(sources, name);
+    if (f)
+        return (f == &unreadable) ? NULL : f;
+    FILE *fp = fopen(name, "r");
+    if (!fp) {
+        map_put(sources, name, &unreadable);
+        return NULL;
+    }
+    return make_file(fp, name);
+}
+
+// Returns the contents of the given line without the line terminator,
+// or NULL if the line is not available.
+char *source_line(char *name, int line, int *len) {
+    File *f = get_source(name);
+    if (!f)
+        return NULL;
+    if (!f->lines)
+        build_line_index(f);
+    if (line < 1 || f->nlines < line)
+        return NULL;
+    char *start = f->data + f->lines[line - 1];
+    char *end = f->data + f->lines[line] - 1;
+    while (start < end && (end[-1] == '\r' || end[-1] == '\n'))
+        end--;
+    *len = end - start;
+    return start;
+}
@@ -3,17 +3,20 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "8cc.h"
 
 bool dumpstack = false;
 bool dumpsource = true;
+bool instrument_functions = false;
+bool instrument_cycles = false;
+bool debug_info = false;
 
 static char *REGS[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char *SREGS[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static char *MREGS[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+static char *CSREGS[] = {"rbx", "r12", "r13", "r14", "r15"};
 static int TAB = 8;
 static Vector *functions = &EMPTY_VECTOR;
 static int stackpos;
@@ -21,11 +24,24 @@ static int numgp;
 static int numfp;
 static FILE *outputfp;
 static Map *source_files = &EMPTY_MAP;
-static Map *source_lines = &EMPTY_MAP;
-static char *last_loc = "";
+static char *last_file;
+static unsigned last_loc;
+static long last_fileno;
+static Node *current_func;
+static char *func_body;    // label at the end of the function prologue
+static int func_stackpos;  // stack position at the end of the prologue
+static bool tail_call_ok;
+static Vector *cycle_funcs = &EMPTY_VECTOR;
+static int cycle_off;
+static Vector *debug_funcs = &EMPTY_VECTOR;
+static Vector *debug_vars = &EMPTY_VECTOR;
+static int nsaved_regs;    // number of callee-saved registers in use
+static int saved_regs_off; // frame offset where they are saved
 
 static void emit_addr(Node *node);
 static void emit_expr(Node *node);
+static void maybe_print_source_loc(Node *node);
+static void emit_func_call(Node *node);
 static void emit_decl_init(Vector *inits, int off, int totalsize);
 static void do_emit_data(Vector *inits, int size, int off, int depth);
 static void emit_data(Node *v, int off, int depth);
@@ -279,6 +295,14 @@ static void maybe_convert_bool(Type *ty) {
     }
 }
 
+// Saves %rax to a register variable. The register always holds the value
+// extended to 64 bits, as emit_lload would have loaded it from memory.
+static void emit_rsave(Type *ty, char *reg) {
+    SAVE;
+    maybe_convert_bool(ty);
+    emit("%s #%s, #%s", get_load_inst(ty), get_int_reg(ty, 'a'), reg);
+}
+
 static void emit_gsave(char *varname, Type *ty, int off) {
     SAVE;
     assert(ty->kind != KIND_ARRAY);
@@ -304,8 +328,22 @@ static void emit_lsave(Type *ty, int off) {
     }
 }
 
+// Pushes the value of an expression of the given type.
+static void push_value(Type *ty) {
+    if (is_flotype(ty))
+        push_xmm(0);
+    else
+        push("rax");
+}
+
+// Stores the value pushed by push_value to the address in %rax.
 static void do_emit_assign_deref(Type *ty, int off) {
     SAVE;
+    if (is_flotype(ty)) {
+        pop_xmm(0);
+        emit("%s #xmm0, %d(#rax)", (ty->kind == KIND_FLOAT) ? "movss" : "movsd", off);
+        return;
+    }
     emit("mov (#rsp), #rcx");
     char *reg = get_int_reg(ty, 'c');
     if (off)
@@ -317,7 +355,7 @@ static void do_emit_assign_deref(Type *ty, int off) {
 
 static void emit_assign_deref(Node *var) {
     SAVE;
-    push("rax");
+    push_value(var->ty);
     emit_expr(var->operand);
     do_emit_assign_deref(var->operand->ty->ptr, 0);
 }
@@ -371,7 +409,7 @@ static void emit_assign_struct_ref(Node *struc, Type *field, int off) {
         emit_assign_struct_ref(struc->struc, field, off + struc->ty->offset);
         break;
     case AST_DEREF:
-        push("rax");
+        push_value(field);
         emit_expr(struc->operand);
         do_emit_assign_deref(field, field->offset + off);
         break;
@@ -409,7 +447,10 @@ static void emit_store(Node *var) {
     case AST_STRUCT_REF: emit_assign_struct_ref(var->struc, var->ty, 0); break;
     case AST_LVAR:
         ensure_lvar_init(var);
-        emit_lsave(var->ty, var->loff);
+        if (var->lreg)
+            emit_rsave(var->ty, var->lreg);
+        else
+            emit_lsave(var->ty, var->loff);
         break;
     case AST_GVAR: emit_gsave(var->glabel, var->ty, 0); break;
     default: error("internal error");
@@ -431,7 +472,21 @@ static void emit_to_bool(Type *ty) {
     emit("movzb #al, #eax");
 }
 
-static void emit_comp(char *inst, char *usiginst, Node *node) {
+// Returns the condition code that holds after emit_cmp if the comparison
+// is true, or false if negate is set.
+static char *get_cond_code(Node *node, bool negate) {
+    bool usig = is_flotype(node->left->ty) || node->left->ty->usig;
+    switch (node->kind) {
+    case '<':   return negate ? (usig ? "ae" : "ge") : (usig ? "b" : "l");
+    case OP_LE: return negate ? (usig ? "a" : "g") : (usig ? "na" : "le");
+    case OP_EQ: return negate ? "ne" : "e";
+    case OP_NE: return negate ? "e" : "ne";
+    default:
+        error("internal error: %s", node2s(node));
+    }
+}
+
+static void emit_cmp(Node *node) {
     SAVE;
     if (is_flotype(node->left->ty)) {
         emit_expr(node->left);
@@ -453,10 +508,12 @@ static void emit_comp(char *inst, char *usiginst, Node *node) {
         else
           emit("cmp #eax, #ecx");
     }
-    if (is_flotype(node->left->ty) || node->left->ty->usig)
-        emit("%s #al", usiginst);
-    else
-        emit("%s #al", inst);
+}
+
+static void emit_comp(Node *node) {
+    SAVE;
+    emit_cmp(node);
+    emit("set%s #al", get_cond_code(node, false));
     emit("movzb #al, #eax");
 }
 
@@ -533,10 +590,39 @@ static void emit_load_convert(Type *to, Type *from) {
         emit_toint(from);
 }
 
+static void emit_cfi_saved_regs() {
+    // The CFA is rbp + 16.
+    for (int i = 0; i < nsaved_regs; i++)
+        emit(".cfi_offset #%s, %d", CSREGS[i], saved_regs_off + i * 8 - 16);
+}
+
+static void emit_restore_regs() {
+    for (int i = 0; i < nsaved_regs; i++)
+        emit("mov %d(#rbp), #%s", saved_regs_off + i * 8, CSREGS[i]);
+}
+
+static void emit_func_exit(void);
+
+// Tears down the stack frame. The caller must emit a ret or a jump and
+// then emit_end_leave, which restores the unwind state for the code
+// that follows, where the frame is still alive.
+static void emit_leave() {
+    emit_restore_regs();
+    emit(".cfi_remember_state");
+    emit("leave");
+    emit(".cfi_def_cfa #rsp, 8");
+}
+
+static void emit_end_leave() {
+    emit(".cfi_restore_state");
+}
+
 static void emit_ret() {
     SAVE;
-    emit("leave");
+    emit_func_exit();
+    emit_leave();
     emit("ret");
+    emit_end_leave();
 }
 
 static void emit_binop(Node *node) {
@@ -546,10 +632,12 @@ static void emit_binop(Node *node) {
         return;
     }
     switch (node->kind) {
-    case '<': emit_comp("setl", "setb", node); return;
-    case OP_EQ: emit_comp("sete", "sete", node); return;
-    case OP_LE: emit_comp("setle", "setna", node); return;
-    case OP_NE: emit_comp("setne", "setne", node); return;
+    case '<':
+    case OP_EQ:
+    case OP_LE:
+    case OP_NE:
+        emit_comp(node);
+        return;
     }
     if (is_inttype(node->ty))
         emit_binop_int_arith(node);
@@ -591,6 +679,7 @@ static void emit_save_literal(Node *node, Type *totype, int off) {
 static void emit_addr(Node *node) {
     switch (node->kind) {
     case AST_LVAR:
+        assert(!node->lreg);
         ensure_lvar_init(node);
         emit("lea %d(#rbp), #rax", node->loff);
         break;
@@ -701,11 +790,6 @@ static void set_reg_nums(Vector *args) {
     }
 }
 
-static void emit_je(char *label) {
-    emit("test #rax, #rax");
-    emit("je %s", label);
-}
-
 static void emit_label(char *label) {
     emit("%s:", label);
 }
@@ -714,6 +798,81 @@ static void emit_jmp(char *label) {
     emit("jmp %s", label);
 }
 
+/*
+ * Conditional branches
+ *
+ * emit_cond jumps to the label if the truth value of the node is jumpif
+ * and falls through otherwise. Comparisons branch on the flags directly
+ * instead of materializing a boolean, and "&&" and "||" jump straight to
+ * the final destination.
+ */
+
+static bool is_boolean_expr(Node *node) {
+    switch (node->kind) {
+    case '<': case OP_EQ: case OP_LE: case OP_NE:
+    case '!': case OP_LOGAND: case OP_LOGOR:
+        return true;
+    }
+    return false;
+}
+
+static void emit_cond(Node *node, char *label, bool jumpif) {
+    SAVE;
+    switch (node->kind) {
+    case '<':
+    case OP_EQ:
+    case OP_LE:
+    case OP_NE:
+        maybe_print_source_loc(node);
+        emit_cmp(node);
+        emit("j%s %s", get_cond_code(node, !jumpif), label);
+        return;
+    case '!':
+        emit_cond(node->operand, label, !jumpif);
+        return;
+    case OP_LOGAND:
+    case OP_LOGOR: {
+        // "a && b" is false and "a || b" is true as soon as a is.
+        bool shortcut = (node->kind == OP_LOGOR);
+        if (jumpif == shortcut) {
+            emit_cond(node->left, label, jumpif);
+            emit_cond(node->right, label, jumpif);
+        } else {
+            char *skip = make_label();
+            emit_cond(node->left, skip, shortcut);
+            emit_cond(node->right, label, jumpif);
+            emit_label(skip);
+        }
+        return;
+    }
+    case AST_LITERAL:
+        if (is_inttype(node->ty)) {
+            if (!!node->ival == jumpif)
+                emit_jmp(label);
+            return;
+        }
+        break;
+    case AST_CONV:
+        // Conversions of a 0/1 result (e.g. to __builtin_expect's long
+        // parameter) do not change its truth value.
+        if (is_inttype(node->ty) && is_boolean_expr(node->operand)) {
+            emit_cond(node->operand, label, jumpif);
+            return;
+        }
+        break;
+    case AST_FUNCALL:
+        // The expected value is only a layout hint; test the expression.
+        if (!strcmp(node->fname, "__builtin_expect")) {
+            emit_cond(vec_head(node->args), label, jumpif);
+            return;
+        }
+        break;
+    }
+    emit_expr(node);
+    emit("test #rax, #rax");
+    emit("%s %s", jumpif ? "jne" : "je", label);
+}
+
 static void emit_literal(Node *node) {
     SAVE;
     switch (node->ty->kind) {
@@ -734,10 +893,10 @@ static void emit_literal(Node *node) {
         if (!node->flabel) {
             node->flabel = make_label();
             float fval = node->fval;
-            emit_noindent(".data");
+            emit_noindent(".pushsection .data");
             emit_label(node->flabel);
             emit(".long %d", *(uint32_t *)&fval);
-            emit_noindent(".text");
+            emit_noindent(".popsection");
         }
         emit("movss %s(#rip), #xmm0", node->flabel);
         break;
@@ -746,10 +905,10 @@ static void emit_literal(Node *node) {
     case KIND_LDOUBLE: {
         if (!node->flabel) {
             node->flabel = make_label();
-            emit_noindent(".data");
+            emit_noindent(".pushsection .data");
             emit_label(node->flabel);
             emit(".quad %lu", *(uint64_t *)&node->fval);
-            emit_noindent(".text");
+            emit_noindent(".popsection");
         }
         emit("movsd %s(#rip), #xmm0", node->flabel);
         break;
@@ -757,10 +916,10 @@ static void emit_literal(Node *node) {
     case KIND_ARRAY: {
         if (!node->slabel) {
             node->slabel = make_label();
-            emit_noindent(".data");
+            emit_noindent(".pushsection .data");
             emit_label(node->slabel);
             emit(".string \"%s\"", quote_cstring_len(node->sval, node->ty->size - 1));
-            emit_noindent(".text");
+            emit_noindent(".popsection");
         }
         emit("lea %s(#rip), #rax", node->slabel);
         break;
@@ -770,91 +929,40 @@ static void emit_literal(Node *node) {
     }
 }
 
-static char **split(char *buf) {
-    char *p = buf;
-    int len = 1;
-    while (*p) {
-        if (p[0] == '\r' && p[1] == '\n') {
-            len++;
-            p += 2;
-            continue;
-        }
-        if (p[0] == '\r' || p[0] == '\n')
-            len++;
-        p++;
-    }
-    p = buf;
-    char **r = malloc(sizeof(char *) * len + 1);
-    int i = 0;
-    while (*p) {
-        if (p[0] == '\r' && p[1] == '\n') {
-            p[0] = '\0';
-            p += 2;
-            r[i++] = p;
-            continue;
-        }
-        if (p[0] == '\r' || p[0] == '\n') {
-            p[0] = '\0';
-            r[i++] = p + 1;
-        }
-        p++;
-    }
-    r[i] = NULL;
-    return r;
-}
-
-static char **read_source_file(char *file) {
-    FILE *fp = fopen(file, "r");
-    if (!fp)
-        return NULL;
-    struct stat st;
-    fstat(fileno(fp), &st);
-    char *buf = malloc(st.st_size + 1);
-    if (fread(buf, 1, st.st_size, fp) != st.st_size) {
-        fclose(fp);
-        return NULL;
-    }
-    fclose(fp);
-    buf[st.st_size] = '\0';
-    return split(buf);
-}
-
 static void maybe_print_source_line(char *file, int line) {
     if (!dumpsource)
         return;
-    char **lines = map_get(source_lines, file);
-    if (!lines) {
-        lines = read_source_file(file);
-        if (!lines)
-            return;
-        map_put(source_lines, file, lines);
-    }
-    int len = 0;
-    for (char **p = lines; *p; p++)
-        len++;
-    emit_nostack("# %s", lines[line - 1]);
+    int len;
+    char *s = source_line(file, line, &len);
+    if (s)
+        emit_nostack("# %.*s", len, s);
 }
 
 static void maybe_print_source_loc(Node *node) {
-    if (!node->sourceLoc)
+    if (!node->loc || node->loc == last_loc)
         return;
-    char *file = node->sourceLoc->file;
-    long fileno = (long)map_get(source_files, file);
-    if (!fileno) {
-        fileno = map_len(source_files) + 1;
-        map_put(source_files, file, (void *)fileno);
-        emit(".file %ld \"%s\"", fileno, quote_cstring(file));
-    }
-    char *loc = format(".loc %ld %d 0", fileno, node->sourceLoc->line);
-    if (strcmp(loc, last_loc)) {
-        emit("%s", loc);
-        maybe_print_source_line(file, node->sourceLoc->line);
+    char *file = loc_file(node->loc);
+    int line = loc_line(node->loc);
+    if (file != last_file) {
+        last_fileno = (long)map_get(source_files, file);
+        if (!last_fileno) {
+            last_fileno = map_len(source_files) + 1;
+            map_put(source_files, file, (void *)last_fileno);
+            emit(".file %ld \"%s\"", last_fileno, quote_cstring(file));
+        }
     }
-    last_loc = loc;
+    emit(".loc %ld %d 0", last_fileno, line);
+    maybe_print_source_line(file, line);
+    last_file = file;
+    last_loc = node->loc;
 }
 
 static void emit_lvar(Node *node) {
     SAVE;
+    if (node->lreg) {
+        emit("mov #%s, #rax", node->lreg);
+        return;
+    }
     ensure_lvar_init(node);
     emit_lload(node->ty, "rbp", node->loff);
 }
@@ -908,6 +1016,189 @@ static void emit_builtin_va_start(Node *node) {
     pop("rcx");
 }
 
+/*
+ * Inline expansion of builtins
+ */
+
+#define MAX_INLINE_MEMOP 128
+
+// Returns the constant size argument of memcpy or memset, or -1.
+static long get_memop_size(Node *node) {
+    if (node->kind == AST_CONV)
+        node = node->operand;
+    if (node->kind != AST_LITERAL || !is_inttype(node->ty))
+        return -1;
+    return node->ival;
+}
+
+static char *get_chunk_reg(char *reg64, int size) {
+    if (!strcmp(reg64, "r11"))
+        return (size == 8) ? "r11" : (size == 4) ? "r11d" : (size == 2) ? "r11w" : "r11b";
+    return (size == 8) ? "rcx" : (size == 4) ? "ecx" : (size == 2) ? "cx" : "cl";
+}
+
+// Calls the library function instead of the builtin.
+static void emit_libcall(Node *node, char *fname) {
+    Node *call = copy_node(node);
+    call->fname = fname;
+    emit_func_call(call);
+}
+
+// Copies a small constant number of bytes with 8/4/2/1-byte moves.
+static void emit_builtin_memcpy(Node *node) {
+    SAVE;
+    long size = get_memop_size(vec_get(node->args, 2));
+    if (size < 0 || size > MAX_INLINE_MEMOP) {
+        emit_libcall(node, "memcpy");
+        return;
+    }
+    push("rcx");
+    push("r11");
+    emit_expr(vec_get(node->args, 1));
+    push("rax");
+    emit_expr(vec_get(node->args, 0));
+    pop("rcx");
+    for (int off = 0, chunk = 8; off < size; ) {
+        if (size - off < chunk) {
+            chunk /= 2;
+            continue;
+        }
+        char *reg = get_chunk_reg("r11", chunk);
+        emit("mov %d(#rcx), #%s", off, reg);
+        emit("mov #%s, %d(#rax)", reg, off);
+        off += chunk;
+    }
+    pop("r11");
+    pop("rcx");
+}
+
+// Fills a small constant number of bytes with a replicated byte pattern.
+static void emit_builtin_memset(Node *node) {
+    SAVE;
+    long size = get_memop_size(vec_get(node->args, 2));
+    if (size < 0 || size > MAX_INLINE_MEMOP) {
+        emit_libcall(node, "memset");
+        return;
+    }
+    push("rcx");
+    push("r11");
+    emit_expr(vec_get(node->args, 1));
+    push("rax");
+    emit_expr(vec_get(node->args, 0));
+    pop("rcx");
+    emit("movzbl #cl, #ecx");
+    emit("mov $0x0101010101010101, #r11");
+    emit("imul #r11, #rcx");
+    for (int off = 0, chunk = 8; off < size; ) {
+        if (size - off < chunk) {
+            chunk /= 2;
+            continue;
+        }
+        emit("mov #%s, %d(#rax)", get_chunk_reg("rcx", chunk), off);
+        off += chunk;
+    }
+    pop("r11");
+    pop("rcx");
+}
+
+// Counts bits with the usual SWAR reduction; POPCNT is not in the
+// x86-64 baseline.
+static void emit_builtin_popcount(Node *node, bool wide) {
+    SAVE;
+    emit_expr(vec_head(node->args));
+    push("rcx");
+    if (!wide) {
+        emit("mov #eax, #ecx");
+        emit("shr $1, #ecx");
+        emit("and $0x55555555, #ecx");
+        emit("sub #ecx, #eax");
+        emit("mov #eax, #ecx");
+        emit("and $0x33333333, #ecx");
+        emit("shr $2, #eax");
+        emit("and $0x33333333, #eax");
+        emit("add #ecx, #eax");
+        emit("mov #eax, #ecx");
+        emit("shr $4, #ecx");
+        emit("add #ecx, #eax");
+        emit("and $0x0f0f0f0f, #eax");
+        emit("imul $0x01010101, #eax, #eax");
+        emit("shr $24, #eax");
+        pop("rcx");
+        return;
+    }
+    push("r11");
+    emit("mov #rax, #rcx");
+    emit("shr $1, #rcx");
+    emit("mov $0x5555555555555555, #r11");
+    emit("and #r11, #rcx");
+    emit("sub #rcx, #rax");
+    emit("mov $0x3333333333333333, #r11");
+    emit("mov #rax, #rcx");
+    emit("and #r11, #rcx");
+    emit("shr $2, #rax");
+    emit("and #r11, #rax");
+    emit("add #rcx, #rax");
+    emit("mov #rax, #rcx");
+    emit("shr $4, #rcx");
+    emit("add #rcx, #rax");
+    emit("mov $0x0f0f0f0f0f0f0f0f, #r11");
+    emit("and #r11, #rax");
+    emit("mov $0x0101010101010101, #r11");
+    emit("imul #r11, #rax");
+    emit("shr $56, #rax");
+    pop("r11");
+    pop("rcx");
+}
+
+// The result is undefined for zero, as in GCC.
+static void emit_builtin_clz(Node *node, bool wide) {
+    SAVE;
+    emit_expr(vec_head(node->args));
+    if (wide) {
+        emit("bsr #rax, #rax");
+        emit("xor $63, #eax");
+    } else {
+        emit("bsr #eax, #eax");
+        emit("xor $31, #eax");
+    }
+}
+
+static void emit_builtin_ctz(Node *node, bool wide) {
+    SAVE;
+    emit_expr(vec_head(node->args));
+    if (wide)
+        emit("bsf #rax, #rax");
+    else
+        emit("bsf #eax, #eax");
+}
+
+static void emit_builtin_bswap(Node *node, int size) {
+    SAVE;
+    emit_expr(vec_head(node->args));
+    if (size == 2) {
+        emit("rol $8, #ax");
+        emit("movzwl #ax, #eax");
+    } else {
+        emit("bswap #%s", size == 4 ? "eax" : "rax");
+    }
+}
+
+// __builtin_prefetch(addr, rw, locality). Locality 3 (the default)
+// keeps the line in all cache levels and 0 marks it non-temporal.
+static void emit_builtin_prefetch(Node *node) {
+    SAVE;
+    int locality = 3;
+    if (vec_len(node->args) > 2) {
+        Node *arg = vec_get(node->args, 2);
+        if (arg->kind != AST_LITERAL || !is_inttype(arg->ty))
+            error("__builtin_prefetch: locality must be a constant");
+        locality = arg->ival;
+    }
+    emit_expr(vec_head(node->args));
+    static char *insts[] = { "prefetchnta", "prefetcht2", "prefetcht1", "prefetcht0" };
+    emit("%s (#rax)", insts[(locality < 0 || locality > 3) ? 3 : locality]);
+}
+
 static bool maybe_emit_builtin(Node *node) {
     SAVE;
     if (!strcmp("__builtin_return_address", node->fname)) {
@@ -922,7 +1213,35 @@ static bool maybe_emit_builtin(Node *node) {
         emit_builtin_va_start(node);
         return true;
     }
-    return false;
+    char *name = node->fname;
+    if (strncmp(name, "__builtin_", 10))
+        return false;
+    name += 10;
+    bool wide = (name[strlen(name) - 1] == 'l');
+    if (!strcmp(name, "memcpy")) {
+        emit_builtin_memcpy(node);
+    } else if (!strcmp(name, "memset")) {
+        emit_builtin_memset(node);
+    } else if (!strncmp(name, "popcount", 8)) {
+        emit_builtin_popcount(node, wide);
+    } else if (!strncmp(name, "clz", 3)) {
+        emit_builtin_clz(node, wide);
+    } else if (!strncmp(name, "ctz", 3)) {
+        emit_builtin_ctz(node, wide);
+    } else if (!strcmp(name, "bswap16")) {
+        emit_builtin_bswap(node, 2);
+    } else if (!strcmp(name, "bswap32")) {
+        emit_builtin_bswap(node, 4);
+    } else if (!strcmp(name, "bswap64")) {
+        emit_builtin_bswap(node, 8);
+    } else if (!strcmp(name, "expect")) {
+        emit_expr(vec_head(node->args));
+    } else if (!strcmp(name, "prefetch")) {
+        emit_builtin_prefetch(node);
+    } else {
+        return false;
+    }
+    return true;
 }
 
 static void classify_args(Vector *ints, Vector *floats, Vector *rest, Vector *args) {
@@ -1050,6 +1369,19 @@ static void emit_decl(Node *node) {
     SAVE;
     if (!node->declinit)
         return;
+    char *reg = node->declvar->lreg;
+    if (reg) {
+        // A register variable is a scalar, so it has at most one initializer.
+        if (vec_len(node->declinit) == 0) {
+            emit("mov $0, #%s", reg);
+            return;
+        }
+        Node *init = vec_head(node->declinit);
+        emit_expr(init->initval);
+        emit_load_convert(init->totype, init->initval->ty);
+        emit_rsave(init->totype, reg);
+        return;
+    }
     emit_decl_init(node->declinit, node->declvar->loff, node->declvar->ty->size);
 }
 
@@ -1066,22 +1398,100 @@ static void emit_deref(Node *node) {
     emit_load_convert(node->ty, node->operand->ty->ptr);
 }
 
-static void emit_ternary(Node *node) {
+// A branch arm that never ran according to the profile. These are
+// emitted after the function, in .text.unlikely.
+typedef struct {
+    char *label;
+    Node *body;
+    char *end;      // where to jump back to
+    int stackpos;
+} ColdBlock;
+
+static Vector *cold_blocks;
+
+// Counts executions of an arm of a branch with -fprofile-generate.
+// Arm 0 is the then branch and arm 1 is the else branch.
+static void emit_count(Node *node, int arm) {
+    if (profile_generate && node->profid)
+        emit("incq .Lprof+%d(#rip)", (node->profid + arm) * 8);
+}
+
+// Instrumented code needs a block of its own for each arm of a branch.
+static void emit_counted_ternary(Node *node) {
     SAVE;
-    emit_expr(node->cond);
     char *ne = make_label();
-    emit_je(ne);
+    char *end = make_label();
+    emit_cond(node->cond, ne, false);
+    emit_count(node, 0);
     if (node->then)
         emit_expr(node->then);
-    if (node->els) {
-        char *end = make_label();
-        emit_jmp(end);
-        emit_label(ne);
+    emit_jmp(end);
+    emit_label(ne);
+    emit_count(node, 1);
+    if (node->els)
         emit_expr(node->els);
+    emit_label(end);
+}
+
+static void emit_ternary(Node *node) {
+    SAVE;
+    if (profile_generate && node->profid && (node->then || node->kind == AST_IF)) {
+        emit_counted_ternary(node);
+        return;
+    }
+    // Loops are lowered to "if (cond) goto" or "if (cond) ... else goto".
+    if (node->then && node->then->kind == AST_GOTO && !node->els) {
+        emit_cond(node->cond, node->then->newlabel, true);
+        return;
+    }
+    if (node->els && node->els->kind == AST_GOTO) {
+        emit_cond(node->cond, node->els->newlabel, false);
+        if (node->then)
+            emit_expr(node->then);
+        return;
+    }
+    if (!node->then) {
+        char *end = make_label();
+        if (node->kind == AST_TERNARY) {
+            // [GNU] "a ?: b" yields the value of a if it is nonzero.
+            emit_expr(node->cond);
+            emit("test #rax, #rax");
+            emit("jne %s", end);
+        } else {
+            emit_cond(node->cond, end, true);
+        }
+        if (node->els)
+            emit_expr(node->els);
         emit_label(end);
+        return;
+    }
+    // With a profile, the more frequent arm becomes the fall-through
+    // path, and an arm that never ran is moved out of line.
+    long nthen = profile_count(node->profid);
+    long nels = profile_count(node->profid + 1);
+    bool swap = (nels > nthen) && (node->els || nthen == 0);
+    Node *hot = swap ? node->els : node->then;
+    Node *cold = swap ? node->then : node->els;
+    bool unlikely = cold && (swap ? nthen : nels) == 0 && (swap ? nels : nthen) > 0;
+    char *ne = make_label();
+    emit_cond(node->cond, ne, swap);
+    if (hot)
+        emit_expr(hot);
+    if (!cold) {
+        emit_label(ne);
+        return;
+    }
+    char *end = make_label();
+    if (unlikely) {
+        ColdBlock *b = malloc(sizeof(ColdBlock));
+        *b = (ColdBlock){ ne, cold, end, stackpos };
+        vec_push(cold_blocks, b);
     } else {
+        emit_jmp(end);
         emit_label(ne);
+        emit_expr(cold);
     }
+    emit_label(end);
 }
 
 static void emit_goto(Node *node) {
@@ -1090,8 +1500,148 @@ static void emit_goto(Node *node) {
     emit_jmp(node->newlabel);
 }
 
+/*
+ * Tail calls
+ *
+ * In "return f(x)" our stack frame is dead once the arguments are in
+ * registers, so we tear down the frame and jump to f, which returns
+ * directly to our caller. A self-recursive tail call becomes a jump back
+ * to the top of the function body after the arguments are stored to the
+ * parameters. Both are valid only if no local variable escapes, because
+ * the callee may otherwise use a pointer into our frame.
+ */
+
+static bool frame_escapes(Node *func) {
+    for (int i = 0; i < vec_len(func->params); i++)
+        if (((Node *)vec_get(func->params, i))->addrtaken)
+            return true;
+    for (int i = 0; i < vec_len(func->localvars); i++)
+        if (((Node *)vec_get(func->localvars, i))->addrtaken)
+            return true;
+    return false;
+}
+
+// Returns the operand if the conversion doesn't need any instruction for
+// a return value. Narrow integers are excluded because the code that
+// extends them to the full register width lives in the returning function.
+static Node *strip_return_conv(Node *val) {
+    if (val->kind != AST_CONV)
+        return val;
+    Type *to = val->ty;
+    Type *from = val->operand->ty;
+    if (to->kind == KIND_PTR && from->kind == KIND_PTR)
+        return val->operand;
+    if (to->kind != from->kind || to->usig != from->usig)
+        return val;
+    if (to->kind != KIND_VOID && to->size < 4)
+        return val;
+    return val->operand;
+}
+
+// Returns true if val is a function call whose arguments are all passed
+// in registers.
+static bool is_tail_call(Node *val) {
+    if (val->kind == AST_FUNCALL) {
+        if (!strncmp(val->fname, "__builtin_", 10))
+            return false;
+    } else if (val->kind != AST_FUNCPTR_CALL) {
+        return false;
+    }
+    if (val->ty->kind == KIND_STRUCT)
+        return false;
+    Vector *ints = make_vector();
+    Vector *floats = make_vector();
+    Vector *rest = make_vector();
+    classify_args(ints, floats, rest, val->args);
+    return vec_len(rest) == 0;
+}
+
+static bool has_tail_call(Node *val) {
+    val = strip_return_conv(val);
+    if (val->kind == AST_TERNARY && val->then)
+        return has_tail_call(val->then) || has_tail_call(val->els);
+    return is_tail_call(val);
+}
+
+static bool is_self_call(Node *call) {
+    if (call->kind != AST_FUNCALL || strcmp(call->fname, current_func->fname))
+        return false;
+    Type *ty = current_func->ty;
+    return !ty->hasva && !ty->oldstyle && stackpos == func_stackpos &&
+        vec_len(call->args) == vec_len(current_func->params);
+}
+
+static void emit_tail_call(Node *call) {
+    SAVE;
+    bool isptr = (call->kind == AST_FUNCPTR_CALL);
+    Type *ftype = isptr ? call->fptr->ty->ptr : call->ftype;
+    Vector *ints = make_vector();
+    Vector *floats = make_vector();
+    Vector *rest = make_vector();
+    classify_args(ints, floats, rest, call->args);
+    if (isptr) {
+        emit_expr(call->fptr);
+        push("rax");
+    }
+    emit_args(ints);
+    emit_args(floats);
+    pop_float_args(vec_len(floats));
+    pop_int_args(vec_len(ints));
+    if (isptr)
+        pop("r11");
+
+    if (is_self_call(call)) {
+        int ireg = 0, xreg = 0;
+        for (int i = 0; i < vec_len(current_func->params); i++) {
+            Node *v = vec_get(current_func->params, i);
+            if (is_flotype(v->ty))
+                emit("movsd #xmm%d, %d(#rbp)", xreg++, v->loff);
+            else
+                emit("mov #%s, %d(#rbp)", REGS[ireg++], v->loff);
+        }
+        emit_jmp(func_body);
+        return;
+    }
+    if (ftype->hasva)
+        emit("mov $%u, #eax", vec_len(floats));
+    emit_leave();
+    if (isptr)
+        emit("jmp *#r11");
+    else
+        emit("jmp %s", call->fname);
+    emit_end_leave();
+}
+
+// Emits "return val" where val contains a tail call, possibly in a
+// branch of a conditional expression.
+static void emit_tail_return(Node *val) {
+    SAVE;
+    Node *e = strip_return_conv(val);
+    if (e->kind == AST_TERNARY && e->then) {
+        char *ne = make_label();
+        emit_cond(e->cond, ne, false);
+        emit_count(e, 0);
+        emit_tail_return(e->then);
+        emit_label(ne);
+        emit_count(e, 1);
+        emit_tail_return(e->els);
+        return;
+    }
+    if (is_tail_call(e)) {
+        emit_tail_call(e);
+        return;
+    }
+    emit_expr(val);
+    maybe_booleanize_retval(val->ty);
+    emit_ret();
+}
+
 static void emit_return(Node *node) {
     SAVE;
+    if (tail_call_ok && node->retval && has_tail_call(node->retval)) {
+        emit_tail_return(node->retval);
+        return;
+    }
     if (node->retval) {
         emit_expr(node->retval);
         maybe_booleanize_retval(node->retval->ty);
@@ -1099,38 +1649,328 @@ static void emit_return(Node *node) {
     emit_ret();
 }
 
-static void emit_compound_stmt(Node *node) {
+/*
+ * Vectorization
+ *
+ * A for loop of the form
+ *
+ *   for (; i < n; i++) a[i] = <expr>;    or    for (; i < n; i++) s += <expr>;
+ *
+ * where <expr> is built from b[i], loop-invariant variables and constants
+ * with operators that SSE2 can do elementwise on int, long, float or double,
+ * gets a vector loop in front of it that handles 16 bytes per iteration.
+ * The original loop then runs as the epilogue for the remaining elements.
+ * Sums are only vectorized for integers, as reassociating floating point
+ * additions would change the result.
+ *
+ * If a[i] is stored a few elements ahead of some b[i], the vector loop
+ * would read b before the scalar loop had written it, so that case is
+ * checked at runtime and handed to the scalar loop.
+ */
+
+#define MAX_VECTOR_INVARIANTS 7
+#define MAX_VECTOR_DEPTH 7
+
+typedef struct {
+    Node *iv;       // induction variable
+    Node *limit;
+    Node *store;    // a[i], or NULL for a sum
+    Node *sum;      // s, or NULL for a store
+    Node *expr;
+    Type *ty;       // element type
+    Vector *invs;   // loop-invariant operands, kept in %xmm8 and up
+    Vector *loads;  // base pointers of the b[i]s
+} VectorLoop;
+
+static bool is_vector_type(Type *ty) {
+    switch (ty->kind) {
+    case KIND_INT: case KIND_LONG: case KIND_LLONG: case KIND_FLOAT: case KIND_DOUBLE:
+        return true;
+    }
+    return false;
+}
+
+static char *get_vector_inst(int op, Type *ty) {
+    if (ty->kind == KIND_FLOAT || ty->kind == KIND_DOUBLE) {
+        char *sfx = (ty->kind == KIND_FLOAT) ? "ps" : "pd";
+        switch (op) {
+        case '+': return format("add%s", sfx);
+        case '-': return format("sub%s", sfx);
+        case '*': return format("mul%s", sfx);
+        case '/': return format("div%s", sfx);
+        }
+        return NULL;
+    }
+    switch (op) {
+    case '+': return (ty->size == 4) ? "paddd" : "paddq";
+    case '-': return (ty->size == 4) ? "psubd" : "psubq";
+    case '&': return "pand";
+    case '|': return "por";
+    case '^': return "pxor";
+    }
+    return NULL;
+}
+
+static bool same_kind(Type *a, Type *b) {
+    return a->kind == b->kind && a->size == b->size;
+}
+
+// A variable that the loop doesn't modify. Its address must not be taken
+// because the loop stores through pointers.
+static bool is_vector_invariant(VectorLoop *vl, Node *node) {
+    return node->kind == AST_LVAR && !node->addrtaken && !node->lvarinit &&
+        node != vl->iv && node != vl->sum;
+}
+
+// Returns the base pointer if the node is base[i].
+static Node *get_vector_base(VectorLoop *vl, Node *node) {
+    if (node->kind != AST_DEREF || !same_kind(node->ty, vl->ty))
+        return NULL;
+    Node *addr = node->operand;
+    if (addr->kind != '+' || addr->ty->kind != KIND_PTR || addr->right != vl->iv)
+        return NULL;
+    if (addr->ty->ptr->size != vl->ty->size)
+        return NULL;
+    Node *base = addr->left;
+    if (base->kind == AST_GVAR && base->ty->kind == KIND_ARRAY)
+        return base;
+    if (base->kind == AST_LVAR && base->ty->kind == KIND_ARRAY && !base->lvarinit)
+        return base;
+    if (base->ty->kind == KIND_PTR && is_vector_invariant(vl, base))
+        return base;
+    return NULL;
+}
+
+static bool match_vector_expr(VectorLoop *vl, Node *node, int depth) {
+    if (depth > MAX_VECTOR_DEPTH || !same_kind(node->ty, vl->ty))
+        return false;
+    if (node->kind == AST_DEREF) {
+        Node *base = get_vector_base(vl, node);
+        if (!base)
+            return false;
+        vec_push(vl->loads, base);
+        return true;
+    }
+    bool isconst = (node->kind == AST_LITERAL) ||
+        (node->kind == AST_CONV && node->operand->kind == AST_LITERAL);
+    if (isconst || is_vector_invariant(vl, node)) {
+        for (int i = 0; i < vec_len(vl->invs); i++)
+            if (vec_get(vl->invs, i) == node)
+                return true;
+        vec_push(vl->invs, node);
+        return vec_len(vl->invs) <= MAX_VECTOR_INVARIANTS;
+    }
+    if (!get_vector_inst(node->kind, vl->ty))
+        return false;
+    return match_vector_expr(vl, node->left, depth) &&
+        match_vector_expr(vl, node->right, depth + 1);
+}
+
+static bool is_unit_step(Node *node, Node *iv) {
+    if (node->kind == OP_PRE_INC || node->kind == OP_POST_INC)
+        return node->operand == iv;
+    if (node->kind != '=' || node->left != iv || node->right->kind != '+')
+        return false;
+    Node *r = node->right;
+    return r->left == iv && r->right->kind == AST_LITERAL && r->right->ival == 1;
+}
+
+// Matches the statements that read_for_stmt produces:
+//   beg: if (i < n) else goto end; body; mid: i++; goto beg; end:
+static bool match_vector_loop(Vector *stmts, int i, VectorLoop *vl) {
+    if (i + 6 >= vec_len(stmts))
+        return false;
+    Node *beg = vec_get(stmts, i);
+    Node *test = vec_get(stmts, i + 1);
+    Node *body = vec_get(stmts, i + 2);
+    Node *step = vec_get(stmts, i + 4);
+    Node *jump = vec_get(stmts, i + 5);
+    Node *end = vec_get(stmts, i + 6);
+    if (beg->kind != AST_LABEL || test->kind != AST_IF || test->then || !test->els ||
+        test->els->kind != AST_GOTO || ((Node *)vec_get(stmts, i + 3))->kind != AST_LABEL ||
+        jump->kind != AST_GOTO || end->kind != AST_LABEL ||
+        strcmp(jump->newlabel, beg->newlabel) || strcmp(test->els->newlabel, end->newlabel))
+        return false;
+
+    Node *cond = test->cond;
+    Node *iv = cond->left;
+    if (cond->kind != '<' || iv->kind != AST_LVAR || iv->addrtaken || !is_inttype(iv->ty) ||
+        iv->ty->size < 4 || iv->ty->usig || !is_unit_step(step, iv))
+        return false;
+    *vl = (VectorLoop){ iv, cond->right };
+    vl->invs = make_vector();
+    vl->loads = make_vector();
+    if (!same_kind(vl->limit->ty, iv->ty) ||
+        (vl->limit->kind != AST_LITERAL && !is_vector_invariant(vl, vl->limit)))
+        return false;
+
+    if (body->kind == AST_COMPOUND_STMT && !body->ty && vec_len(body->stmts) == 1)
+        body = vec_head(body->stmts);
+    if (body->kind != '=' || !is_vector_type(body->ty))
+        return false;
+    vl->ty = body->ty;
+    if (body->left->kind == AST_LVAR) {
+        // s = s + expr
+        Node *r = body->right;
+        if (!is_inttype(vl->ty) || r->kind != '+' || r->left != body->left ||
+            !is_vector_invariant(vl, body->left))
+            return false;
+        vl->sum = body->left;
+        vl->expr = r->right;
+    } else {
+        if (!get_vector_base(vl, body->left))
+            return false;
+        vl->store = body->left;
+        vl->expr = body->right;
+    }
+    return match_vector_expr(vl, vl->expr, 0);
+}
+
+bool is_vector_loop(Vector *stmts, int i) {
+    VectorLoop vl;
+    return match_vector_loop(stmts, i, &vl);
+}
+
+static void emit_broadcast(VectorLoop *vl, int reg) {
+    switch (vl->ty->kind) {
+    case KIND_FLOAT:
+        emit("movaps #xmm0, #xmm%d", reg);
+        emit("shufps $0, #xmm%d, #xmm%d", reg, reg);
+        break;
+    case KIND_DOUBLE:
+        emit("movaps #xmm0, #xmm%d", reg);
+        emit("unpcklpd #xmm%d, #xmm%d", reg, reg);
+        break;
+    case KIND_INT:
+        emit("movd #eax, #xmm%d", reg);
+        emit("pshufd $0, #xmm%d, #xmm%d", reg, reg);
+        break;
+    default:
+        emit("movq #rax, #xmm%d", reg);
+        emit("punpcklqdq #xmm%d, #xmm%d", reg, reg);
+    }
+}
+
+static char *get_vector_move(VectorLoop *vl) {
+    return is_flotype(vl->ty) ? "movups" : "movdqu";
+}
+
+static void emit_vector_expr(VectorLoop *vl, Node *node, int reg) {
     SAVE;
-    for (int i = 0; i < vec_len(node->stmts); i++)
-        emit_expr(vec_get(node->stmts, i));
+    for (int i = 0; i < vec_len(vl->invs); i++) {
+        if (vec_get(vl->invs, i) == node) {
+            emit("movaps #xmm%d, #xmm%d", i + 8, reg);
+            return;
+        }
+    }
+    if (node->kind == AST_DEREF) {
+        emit_expr(get_vector_base(vl, node));
+        emit("%s (#rax,#r10,%d), #xmm%d", get_vector_move(vl), vl->ty->size, reg);
+        return;
+    }
+    emit_vector_expr(vl, node->left, reg);
+    emit_vector_expr(vl, node->right, reg + 1);
+    emit("%s #xmm%d, #xmm%d", get_vector_inst(node->kind, vl->ty), reg + 1, reg);
+}
+
+static bool same_address(Node *a, Node *b) {
+    if (a->kind == AST_GVAR && b->kind == AST_GVAR)
+        return !strcmp(a->glabel, b->glabel);
+    return a == b;
+}
+
+// Jumps to the label if the store is less than 16 bytes ahead of a load.
+static void emit_overlap_check(VectorLoop *vl, char *label) {
+    Node *dst = get_vector_base(vl, vl->store);
+    for (int i = 0; i < vec_len(vl->loads); i++) {
+        Node *src = vec_get(vl->loads, i);
+        if (same_address(dst, src))
+            continue;
+        emit_expr(dst);
+        push("rax");
+        emit_expr(src);
+        pop("rcx");
+        emit("sub #rax, #rcx");
+        emit("sub $1, #rcx");
+        emit("cmp $15, #rcx");
+        emit("jb %s", label);
+    }
 }
 
-static void emit_logand(Node *node) {
+// Emits the vector loop for the loop starting at stmts[i]. The scalar loop
+// follows, so control falls through to it when fewer than 16 bytes are left.
+static void maybe_emit_vector_loop(Vector *stmts, int i) {
     SAVE;
-    char *end = make_label();
-    emit_expr(node->left);
-    emit("test #rax, #rax");
-    emit("mov $0, #rax");
-    emit("je %s", end);
-    emit_expr(node->right);
-    emit("test #rax, #rax");
-    emit("mov $0, #rax");
-    emit("je %s", end);
-    emit("mov $1, #rax");
-    emit_label(end);
+    VectorLoop vl;
+    if (optlevel == 0 || !match_vector_loop(stmts, i, &vl))
+        return;
+    int size = vl.ty->size;
+    int width = 16 / size;
+    char *loop = make_label();
+    char *done = make_label();
+    char *scalar = make_label();
+
+    if (vl.store)
+        emit_overlap_check(&vl, scalar);
+    for (int j = 0; j < vec_len(vl.invs); j++) {
+        emit_expr(vec_get(vl.invs, j));
+        emit_broadcast(&vl, j + 8);
+    }
+    if (vl.sum)
+        emit("pxor #xmm15, #xmm15");
+    emit_expr(vl.limit);
+    emit("mov #rax, #r11");
+    emit_expr(vl.iv);
+    emit("mov #rax, #r10");
+
+    emit_label(loop);
+    emit("lea %d(#r10), #rax", width);
+    emit("cmp #r11, #rax");
+    emit("jg %s", done);
+    emit_vector_expr(&vl, vl.expr, 0);
+    if (vl.store) {
+        emit_expr(get_vector_base(&vl, vl.store));
+        emit("%s #xmm0, (#rax,#r10,%d)", get_vector_move(&vl), size);
+    } else {
+        emit("%s #xmm0, #xmm15", get_vector_inst('+', vl.ty));
+    }
+    emit("add $%d, #r10", width);
+    emit_jmp(loop);
+
+    emit_label(done);
+    if (vl.sum) {
+        emit("pshufd $0x4e, #xmm15, #xmm0");
+        emit("%s #xmm0, #xmm15", get_vector_inst('+', vl.ty));
+        if (size == 4) {
+            emit("pshufd $0xb1, #xmm15, #xmm0");
+            emit("paddd #xmm0, #xmm15");
+        }
+        emit_expr(vl.sum);
+        emit("movq #xmm15, #rcx");
+        emit("add #rcx, #rax");
+        emit_store(vl.sum);
+    }
+    emit("mov #r10, #rax");
+    emit_store(vl.iv);
+    emit_label(scalar);
+}
+
+static void emit_compound_stmt(Node *node) {
+    SAVE;
+    for (int i = 0; i < vec_len(node->stmts); i++) {
+        maybe_emit_vector_loop(node->stmts, i);
+        emit_expr(vec_get(node->stmts, i));
+    }
 }
 
-static void emit_logor(Node *node) {
+static void emit_logand_or(Node *node) {
     SAVE;
+    char *f = make_label();
     char *end = make_label();
-    emit_expr(node->left);
-    emit("test #rax, #rax");
+    emit_cond(node, f, false);
     emit("mov $1, #rax");
-    emit("jne %s", end);
-    emit_expr(node->right);
-    emit("test #rax, #rax");
-    emit("mov $1, #rax");
-    emit("jne %s", end);
+    emit_jmp(end);
+    emit_label(f);
     emit("mov $0, #rax");
     emit_label(end);
 }
@@ -1244,8 +2084,10 @@ static void emit_expr(Node *node) {
     case '&': emit_bitand(node); return;
     case '|': emit_bitor(node); return;
     case '~': emit_bitnot(node); return;
-    case OP_LOGAND: emit_logand(node); return;
-    case OP_LOGOR:  emit_logor(node); return;
+    case OP_LOGAND:
+    case OP_LOGOR:
+        emit_logand_or(node);
+        return;
     case OP_CAST:   emit_cast(node); return;
     case ',': emit_comma(node); return;
     case '=': emit_assign(node); return;
@@ -1263,11 +2105,13 @@ static void emit_zero(int size) {
     for (; size > 0; size--)     emit(".byte 0");
 }
 
-static void emit_padding(Node *node, int off) {
+// Emits zeros up to the initializer and returns their size.
+static int emit_padding(Node *node, int off) {
     SAVE;
     int diff = node->initoff - off;
     assert(diff >= 0);
     emit_zero(diff);
+    return diff;
 }
 
 static void emit_data_addr(Node *operand, int depth) {
@@ -1327,7 +2171,7 @@ static void emit_data_primtype(Type *ty, Node *val, int depth) {
             emit(".quad %s", val->newlabel);
             break;
         }
-        bool is_char_ptr = (val->operand->ty->kind == KIND_ARRAY && val->operand->ty->ptr->kind == KIND_CHAR);
+        bool is_char_ptr = (val->kind == AST_CONV && val->operand->ty->kind == KIND_ARRAY && val->operand->ty->ptr->kind == KIND_CHAR);
         if (is_char_ptr) {
             emit_data_charptr(val->operand->sval, depth);
         } else if (val->kind == AST_GVAR) {
@@ -1358,7 +2202,9 @@ static void do_emit_data(Vector *inits, int size, int off, int depth) {
     for (int i = 0; i < vec_len(inits) && 0 < size; i++) {
         Node *node = vec_get(inits, i);
         Node *v = node->initval;
-        emit_padding(node, off);
+        int pad = emit_padding(node, off);
+        off += pad;
+        size -= pad;
         if (node->totype->bitsize > 0) {
             assert(node->totype->bitoff == 0);
             long data = eval_intexpr(v, NULL);
@@ -1372,7 +2218,7 @@ static void do_emit_data(Vector *inits, int size, int off, int depth) {
                 totype = node->totype;
                 data |= ((((long)1 << totype->bitsize) - 1) & eval_intexpr(v, NULL)) << totype->bitoff;
             }
-            emit_data_primtype(totype, &(Node){ AST_LITERAL, totype, .ival = data }, depth);
+            emit_data_primtype(totype, &(Node){ AST_LITERAL, .ty = totype, .ival = data }, depth);
             off += totype->size;
             size -= totype->size;
             if (i == vec_len(inits))
@@ -1413,6 +2259,11 @@ static void emit_bss(Node *v) {
 
 static void emit_global_var(Node *v) {
     SAVE;
+    emit(".type %s, @object", v->declvar->glabel);
+    if (v->declvar->ty->size >= 0)
+        emit(".size %s, %d", v->declvar->glabel, v->declvar->ty->size);
+    if (debug_info)
+        vec_push(debug_vars, v->declvar);
     if (v->declinit)
         emit_data(v, 0, 0);
     else
@@ -1477,15 +2328,149 @@ static void push_func_params(Vector *params, int off) {
     }
 }
 
+/*
+ * Register promotion
+ *
+ * Integer and pointer variables whose address is never taken are kept in
+ * callee-saved registers instead of the stack frame, so they survive
+ * function calls without being spilled. There are only five of them, so
+ * they go to the most frequently referenced variables. Parameters still
+ * get their stack slots; they are loaded into registers at the top of the
+ * function body.
+ */
+
+static bool is_promotable(Node *v) {
+    if (v->addrtaken || v->nuses == 0 || v->lvarinit)
+        return false;
+    return is_inttype(v->ty) || v->ty->kind == KIND_PTR;
+}
+
+static void add_candidates(Vector *cands, Vector *vars) {
+    for (int i = 0; i < vec_len(vars); i++) {
+        Node *v = vec_get(vars, i);
+        v->lreg = NULL;
+        if (is_promotable(v))
+            vec_push(cands, v);
+    }
+}
+
+static int assign_regs(Node *func) {
+    Vector *cands = make_vector();
+    add_candidates(cands, func->params);
+    add_candidates(cands, func->localvars);
+    int n = 0;
+    for (; n < sizeof(CSREGS) / sizeof(*CSREGS); n++) {
+        Node *best = NULL;
+        for (int i = 0; i < vec_len(cands); i++) {
+            Node *v = vec_get(cands, i);
+            if (!v->lreg && (!best || v->nuses > best->nuses))
+                best = v;
+        }
+        if (!best)
+            break;
+        best->lreg = CSREGS[n];
+    }
+    return n;
+}
+
+/*
+ * Function instrumentation
+ *
+ * With -finstrument-functions, each function calls
+ * __cyg_profile_func_enter(this_fn, call_site) after the prologue and
+ * __cyg_profile_func_exit before it returns, as GCC does. The hooks
+ * themselves are not instrumented.
+ *
+ * -finstrument-functions=cycles needs no hooks: each function reads the
+ * time stamp counter on entry and adds the elapsed cycles to its entry
+ * in a per-file table when it returns. The table is printed to stderr
+ * at exit. The times are inclusive of callees.
+ */
+
+static bool is_instrumented(Node *func) {
+    if (instrument_cycles)
+        return true;
+    return instrument_functions && strncmp(func->fname, "__cyg_profile_func_", 19);
+}
+
+static void emit_hook_call(char *hook) {
+    bool padding = stackpos % 16;
+    if (padding)
+        emit("sub $8, #rsp");
+    emit("lea %s(#rip), #rdi", current_func->fname);
+    emit("mov 8(#rbp), #rsi");
+    emit("call %s", hook);
+    if (padding)
+        emit("add $8, #rsp");
+}
+
+static void emit_rdtsc() {
+    emit("rdtsc");
+    emit("shl $32, #rdx");
+    emit("or #rdx, #rax");
+}
+
+static void emit_func_enter(Node *func) {
+    SAVE;
+    if (!is_instrumented(func))
+        return;
+    if (instrument_cycles) {
+        vec_push(cycle_funcs, func->fname);
+        emit_rdtsc();
+        emit("mov #rax, %d(#rbp)", cycle_off);
+        return;
+    }
+    emit_hook_call("__cyg_profile_func_enter");
+}
+
+// The return value in RAX, RDX, XMM0 and XMM1 must survive.
+static void emit_func_exit() {
+    SAVE;
+    if (!is_instrumented(current_func))
+        return;
+    emit("push #rax");
+    emit("push #rdx");
+    if (instrument_cycles) {
+        int off = (vec_len(cycle_funcs) - 1) * 24;
+        emit_rdtsc();
+        emit("sub %d(#rbp), #rax", cycle_off);
+        emit("incq .Lcycles+%d(#rip)", off + 8);
+        emit("add #rax, .Lcycles+%d(#rip)", off + 16);
+    } else {
+        emit("sub $32, #rsp");
+        emit("movsd #xmm0, (#rsp)");
+        emit("movsd #xmm1, 8(#rsp)");
+        stackpos += 48;
+        emit_hook_call("__cyg_profile_func_exit");
+        stackpos -= 48;
+        emit("movsd (#rsp), #xmm0");
+        emit("movsd 8(#rsp), #xmm1");
+        emit("add $32, #rsp");
+    }
+    emit("pop #rdx");
+    emit("pop #rax");
+}
+
 static void emit_func_prologue(Node *func) {
     SAVE;
-    emit(".text");
+    int hotness = func_hotness(func);
+    if (hotness < 0)
+        emit(".section .text.unlikely,\"ax\",@progbits");
+    else if (hotness > 0)
+        emit(".section .text.hot,\"ax\",@progbits");
+    else
+        emit(".text");
     if (!func->ty->isstatic)
         emit_noindent(".global %s", func->fname);
+    emit(".type %s, @function", func->fname);
     emit_noindent("%s:", func->fname);
+    emit(".cfi_startproc");
     emit("nop");
     push("rbp");
+    emit(".cfi_def_cfa_offset 16");
+    emit(".cfi_offset #rbp, -16");
     emit("mov #rsp, #rbp");
+    emit(".cfi_def_cfa_register #rbp");
     int off = 0;
     if (func->ty->hasva) {
         set_reg_nums(func->params);
@@ -1503,21 +2488,518 @@ static void emit_func_prologue(Node *func) {
         v->loff = off;
         localarea += size;
     }
+    if (instrument_cycles) {
+        off -= 8;
+        cycle_off = off;
+        localarea += 8;
+    }
+    nsaved_regs = assign_regs(func);
+    off -= nsaved_regs * 8;
+    localarea += nsaved_regs * 8;
+    saved_regs_off = off;
     if (localarea) {
         emit("sub $%d, #rsp", localarea);
         stackpos += localarea;
     }
+    for (int i = 0; i < nsaved_regs; i++)
+        emit("mov #%s, %d(#rbp)", CSREGS[i], saved_regs_off + i * 8);
+    emit_cfi_saved_regs();
+    func_stackpos = stackpos;
+    if (profile_generate)
+        emit("incq .Lprof+%d(#rip)", profile_func_counter(func) * 8);
+    emit_func_enter(func);
+    func_body = make_label();
+    emit_label(func_body);
+    for (int i = 0; i < vec_len(func->params); i++) {
+        Node *v = vec_get(func->params, i);
+        if (v->lreg)
+            emit("%s %d(#rbp), #%s", get_load_inst(v->ty), v->loff, v->lreg);
+    }
+}
+
+/*
+ * Debug information
+ *
+ * With -g, we emit a DWARF 4 compilation unit describing functions,
+ * their parameters and local variables, global variables and their
+ * types. Line numbers come from the .loc directives, which are always
+ * emitted, and call frame information from the .cfi directives.
+ *
+ * Locals are listed at the function level without lexical blocks.
+ * Variables kept in callee-saved registers are described as such.
+ * Type DIEs are emitted at the end of the unit, after the DIEs that
+ * refer to them.
+ */
+
+enum {
+    ABBREV_CU = 1,
+    ABBREV_BASE_TYPE,
+    ABBREV_POINTER,
+    ABBREV_VOID_POINTER,
+    ABBREV_STRUCT,
+    ABBREV_UNION,
+    ABBREV_ANON_STRUCT,
+    ABBREV_ANON_UNION,
+    ABBREV_MEMBER,
+    ABBREV_ARRAY,
+    ABBREV_SUBRANGE,
+    ABBREV_SUBRANGE_NOBOUND,
+    ABBREV_FUNC_TYPE,
+    ABBREV_SUBPROGRAM,
+    ABBREV_SUBPROGRAM_VOID,
+    ABBREV_PARAM,
+    ABBREV_LVAR,
+    ABBREV_GVAR,
+};
+
+// Abbreviation code, tag, whether it has children, and pairs of
+// attribute and form terminated by 0.
+static int debug_abbrevs[][16] = {
+    { ABBREV_CU, 0x11, 1, 0x25, 0x08, 0x13, 0x0b, 0x03, 0x08, 0x1b, 0x08, 0x10, 0x17, 0 },
+    { ABBREV_BASE_TYPE, 0x24, 0, 0x03, 0x08, 0x3e, 0x0b, 0x0b, 0x0b, 0 },
+    { ABBREV_POINTER, 0x0f, 0, 0x0b, 0x0b, 0x49, 0x13, 0 },
+    { ABBREV_VOID_POINTER, 0x0f, 0, 0x0b, 0x0b, 0 },
+    { ABBREV_STRUCT, 0x13, 1, 0x03, 0x08, 0x0b, 0x0f, 0 },
+    { ABBREV_UNION, 0x17, 1, 0x03, 0x08, 0x0b, 0x0f, 0 },
+    { ABBREV_ANON_STRUCT, 0x13, 1, 0x0b, 0x0f, 0 },
+    { ABBREV_ANON_UNION, 0x17, 1, 0x0b, 0x0f, 0 },
+    { ABBREV_MEMBER, 0x0d, 0, 0x03, 0x08, 0x49, 0x13, 0x38, 0x0f, 0 },
+    { ABBREV_ARRAY, 0x01, 1, 0x49, 0x13, 0 },
+    { ABBREV_SUBRANGE, 0x21, 0, 0x2f, 0x0f, 0 },
+    { ABBREV_SUBRANGE_NOBOUND, 0x21, 0, 0 },
+    { ABBREV_FUNC_TYPE, 0x15, 0, 0 },
+    { ABBREV_SUBPROGRAM, 0x2e, 1, 0x03, 0x08, 0x3f, 0x0c, 0x11, 0x01, 0x12, 0x07,
+      0x40, 0x18, 0x49, 0x13, 0 },
+    { ABBREV_SUBPROGRAM_VOID, 0x2e, 1, 0x03, 0x08, 0x3f, 0x0c, 0x11, 0x01, 0x12, 0x07,
+      0x40, 0x18, 0 },
+    { ABBREV_PARAM, 0x05, 0, 0x03, 0x08, 0x49, 0x13, 0x02, 0x18, 0 },
+    { ABBREV_LVAR, 0x34, 0, 0x03, 0x08, 0x49, 0x13, 0x02, 0x18, 0 },
+    { ABBREV_GVAR, 0x34, 0, 0x03, 0x08, 0x49, 0x13, 0x3f, 0x0c, 0x02, 0x18, 0 },
+};
+
+#define DW_OP_addr 0x03
+#define DW_OP_reg0 0x50
+#define DW_OP_fbreg 0x91
+#define DW_OP_call_frame_cfa 0x9c
+
+typedef struct {
+    Node *func;
+    char *end;
+} DebugFunc;
+
+static Map *debug_types;        // type key -> DIE label
+static Vector *debug_pending;   // types whose DIEs are not emitted yet
+
+static void add_debug_func(Node *func, char *end) {
+    DebugFunc *f = malloc(sizeof(DebugFunc));
+    *f = (DebugFunc){ func, end };
+    vec_push(debug_funcs, f);
+}
+
+static int sleb128_size(long v) {
+    for (int n = 1;; n++) {
+        int b = v & 0x7f;
+        v >>= 7;
+        if ((v == 0 && !(b & 0x40)) || (v == -1 && (b & 0x40)))
+            return n;
+    }
+}
+
+static char *get_base_type_name(Type *ty, int *enc) {
+    switch (ty->kind) {
+    case KIND_BOOL:  *enc = 2; return "_Bool";
+    case KIND_CHAR:  *enc = ty->usig ? 8 : 6; return ty->usig ? "unsigned char" : "char";
+    case KIND_SHORT: *enc = ty->usig ? 7 : 5; return ty->usig ? "unsigned short" : "short";
+    case KIND_INT:   *enc = ty->usig ? 7 : 5; return ty->usig ? "unsigned int" : "int";
+    case KIND_LONG:  *enc = ty->usig ? 7 : 5; return ty->usig ? "unsigned long" : "long";
+    case KIND_LLONG: *enc = ty->usig ? 7 : 5; return ty->usig ? "unsigned long long" : "long long";
+    case KIND_FLOAT: *enc = 4; return "float";
+    case KIND_DOUBLE: *enc = 4; return "double";
+    case KIND_LDOUBLE: *enc = 4; return "long double";
+    case KIND_ENUM:  *enc = 5; return "int";
+    }
+    return NULL;
+}
+
+// Returns the label of the DIE for the type, or NULL for void.
+static char *get_debug_type(Type *ty) {
+    if (ty->kind == KIND_VOID)
+        return NULL;
+    int enc;
+    char *name = get_base_type_name(ty, &enc);
+    // Base types are shared by name, others by identity.
+    char *key = name ? name : format("%p", ty);
+    char *label = map_get(debug_types, key);
+    if (label)
+        return label;
+    label = make_label();
+    map_put(debug_types, key, label);
+    vec_push(debug_pending, ty);
+    vec_push(debug_pending, label);
+    return label;
+}
+
+static void emit_debug_ref(Type *ty) {
+    emit(".long %s - .Ldebug_info0", get_debug_type(ty));
+}
+
+static void emit_debug_type(Type *ty, char *label) {
+    emit_label(label);
+    int enc;
+    char *name = get_base_type_name(ty, &enc);
+    if (name) {
+        emit(".uleb128 %d", ABBREV_BASE_TYPE);
+        emit(".string \"%s\"", name);
+        emit(".byte %d", enc);
+        emit(".byte %d", ty->size);
+        return;
+    }
+    switch (ty->kind) {
+    case KIND_PTR:
+        if (ty->ptr->kind == KIND_VOID) {
+            emit(".uleb128 %d", ABBREV_VOID_POINTER);
+            emit(".byte 8");
+        } else {
+            emit(".uleb128 %d", ABBREV_POINTER);
+            emit(".byte 8");
+            emit_debug_ref(ty->ptr);
+        }
+        return;
+    case KIND_ARRAY:
+        emit(".uleb128 %d", ABBREV_ARRAY);
+        emit_debug_ref(ty->ptr);
+        if (ty->len > 0) {
+            emit(".uleb128 %d", ABBREV_SUBRANGE);
+            emit(".uleb128 %d", ty->len - 1);
+        } else {
+            emit(".uleb128 %d", ABBREV_SUBRANGE_NOBOUND);
+        }
+        emit(".byte 0");
+        return;
+    case KIND_STRUCT: {
+        if (ty->tag) {
+            emit(".uleb128 %d", ty->is_struct ? ABBREV_STRUCT : ABBREV_UNION);
+            emit(".string \"%s\"", ty->tag);
+        } else {
+            emit(".uleb128 %d", ty->is_struct ? ABBREV_ANON_STRUCT : ABBREV_ANON_UNION);
+        }
+        emit(".uleb128 %d", ty->size < 0 ? 0 : ty->size);
+        Vector *keys = ty->fields ? dict_keys(ty->fields) : &EMPTY_VECTOR;
+        for (int i = 0; i < vec_len(keys); i++) {
+            char *fname = vec_get(keys, i);
+            Type *fty = dict_get(ty->fields, fname);
+            emit(".uleb128 %d", ABBREV_MEMBER);
+            emit(".string \"%s\"", fname);
+            emit_debug_ref(fty->kind == KIND_VOID ? type_int : fty);
+            emit(".uleb128 %d", fty->offset);
+        }
+        emit(".byte 0");
+        return;
+    }
+    default:
+        // Functions and anything else we cannot describe.
+        emit(".uleb128 %d", ABBREV_FUNC_TYPE);
+    }
+}
+
+static void emit_debug_location(Node *var) {
+    if (var->lreg) {
+        int regno = 0;
+        for (int i = 0; i < 5; i++)
+            if (!strcmp(var->lreg, CSREGS[i]))
+                regno = (i == 0) ? 3 : 11 + i;
+        emit(".uleb128 1");
+        emit(".byte %d", DW_OP_reg0 + regno);
+        return;
+    }
+    // The frame base is the CFA, which is rbp + 16.
+    long off = var->loff - 16;
+    emit(".uleb128 %d", 1 + sleb128_size(off));
+    emit(".byte %d", DW_OP_fbreg);
+    emit(".sleb128 %ld", off);
+}
+
+static void emit_debug_vars(Vector *vars, int abbrev) {
+    for (int i = 0; i < vec_len(vars); i++) {
+        Node *v = vec_get(vars, i);
+        // Skip temporaries made by the optimizer.
+        if (!v->varname || strchr(v->varname, '.'))
+            continue;
+        emit(".uleb128 %d", abbrev);
+        emit(".string \"%s\"", v->varname);
+        emit_debug_ref(v->ty);
+        emit_debug_location(v);
+    }
+}
+
+static void emit_debug_func(DebugFunc *f) {
+    Node *func = f->func;
+    Type *rettype = func->ty->rettype;
+    bool isvoid = (rettype->kind == KIND_VOID);
+    emit(".uleb128 %d", isvoid ? ABBREV_SUBPROGRAM_VOID : ABBREV_SUBPROGRAM);
+    emit(".string \"%s\"", func->fname);
+    emit(".byte %d", !func->ty->isstatic);
+    emit(".quad %s", func->fname);
+    emit(".quad %s - %s", f->end, func->fname);
+    emit(".uleb128 1");
+    emit(".byte %d", DW_OP_call_frame_cfa);
+    if (!isvoid)
+        emit_debug_ref(rettype);
+    emit_debug_vars(func->params, ABBREV_PARAM);
+    emit_debug_vars(func->localvars, ABBREV_LVAR);
+    emit(".byte 0");
+}
+
+static void emit_debug_gvar(Node *var) {
+    emit(".uleb128 %d", ABBREV_GVAR);
+    emit(".string \"%s\"", var->varname);
+    emit_debug_ref(var->ty);
+    emit(".byte %d", !var->ty->isstatic);
+    emit(".uleb128 9");
+    emit(".byte %d", DW_OP_addr);
+    emit(".quad %s", var->glabel);
+}
+
+static void emit_debug_abbrevs() {
+    emit_noindent(".section .debug_abbrev,\"\",@progbits");
+    emit_noindent(".Ldebug_abbrev0:");
+    int n = sizeof(debug_abbrevs) / sizeof(*debug_abbrevs);
+    for (int i = 0; i < n; i++) {
+        int *p = debug_abbrevs[i];
+        emit(".uleb128 %d", p[0]);
+        emit(".uleb128 %d", p[1]);
+        emit(".byte %d", p[2]);
+        for (p += 3; *p; p += 2) {
+            emit(".uleb128 %d", p[0]);
+            emit(".uleb128 %d", p[1]);
+        }
+        emit(".byte 0");
+        emit(".byte 0");
+    }
+    emit(".byte 0");
+}
+
+void emit_debug_info() {
+    SAVE;
+    debug_types = make_map();
+    debug_pending = make_vector();
+    emit_debug_abbrevs();
+
+    emit_noindent(".section .debug_info,\"\",@progbits");
+    emit_noindent(".Ldebug_info0:");
+    emit(".long .Ldebug_info_end - .Ldebug_info_start");
+    emit_noindent(".Ldebug_info_start:");
+    emit(".value 4");
+    emit(".long .Ldebug_abbrev0");
+    emit(".byte 8");
+
+    char *cwd = getcwd(NULL, 0);
+    emit(".uleb128 %d", ABBREV_CU);
+    emit(".string \"8cc\"");
+    emit(".byte 0x0c");  // DW_LANG_C99
+    emit(".string \"%s\"", quote_cstring(get_base_file()));
+    emit(".string \"%s\"", quote_cstring(cwd ? cwd : "."));
+    emit(".long .Ldebug_line0");
+    for (int i = 0; i < vec_len(debug_funcs); i++)
+        emit_debug_func(vec_get(debug_funcs, i));
+    for (int i = 0; i < vec_len(debug_vars); i++)
+        emit_debug_gvar(vec_get(debug_vars, i));
+    // Emitting a type may add the types it refers to.
+    for (int i = 0; i < vec_len(debug_pending); i += 2)
+        emit_debug_type(vec_get(debug_pending, i), vec_get(debug_pending, i + 1));
+    emit(".byte 0");
+    emit_noindent(".Ldebug_info_end:");
+
+    // The assembler generates the line number program from the .loc
+    // directives at the start of this section.
+    emit_noindent(".section .debug_line,\"\",@progbits");
+    emit_noindent(".Ldebug_line0:");
+}
+
+// Cold blocks form a separate "function" for the unwinder, with the
+// same frame layout as the function body.
+static void emit_cold_blocks(Node *func) {
+    SAVE;
+    if (vec_len(cold_blocks) == 0)
+        return;
+    char *name = format("%s.cold", func->fname);
+    emit_noindent(".pushsection .text.unlikely");
+    emit(".type %s, @function", name);
+    emit_noindent("%s:", name);
+    emit(".cfi_startproc");
+    emit(".cfi_def_cfa #rbp, 16");
+    emit(".cfi_offset #rbp, -16");
+    emit_cfi_saved_regs();
+    // Emitting a block may add nested cold blocks to the list.
+    for (int i = 0; i < vec_len(cold_blocks); i++) {
+        ColdBlock *b = vec_get(cold_blocks, i);
+        stackpos = b->stackpos;
+        emit_label(b->label);
+        emit_expr(b->body);
+        emit_jmp(b->end);
+    }
+    emit(".cfi_endproc");
+    emit(".size %s, .-%s", name, name);
+    emit_noindent(".popsection");
+}
+
+static void emit_func_epilogue(Node *func) {
+    SAVE;
+    char *end = make_label();
+    emit(".cfi_endproc");
+    emit_label(end);
+    emit(".size %s, .-%s", func->fname, func->fname);
+    emit_cold_blocks(func);
+    if (debug_info)
+        add_debug_func(func, end);
 }
 
 void emit_toplevel(Node *v) {
     stackpos = 8;
     if (v->kind == AST_FUNC) {
+        current_func = v;
+        tail_call_ok = optlevel > 0 && !v->ty->hasva && !frame_escapes(v)
+            && !is_instrumented(v);
+        cold_blocks = make_vector();
         emit_func_prologue(v);
         emit_expr(v->body);
         emit_ret();
+        emit_func_epilogue(v);
     } else if (v->kind == AST_DECL) {
         emit_global_var(v);
     } else {
         error("internal error");
     }
 }
+
+// Emits a constructor that registers fn with atexit.
+static void emit_atexit(char *init, char *fn) {
+    emit_noindent("%s:", init);
+    emit("sub $8, #rsp");
+    emit("lea %s(#rip), #rdi", fn);
+    emit("call atexit");
+    emit("add $8, #rsp");
+    emit("ret");
+    emit(".section .init_array,\"aw\"");
+    emit(".align 8");
+    emit(".quad %s", init);
+}
+
+/*
+ * Profile instrumentation
+ *
+ * With -fprofile-generate, the counters live in .Lprof. A constructor
+ * registers a function with atexit that appends a header line and the
+ * value of each counter to the profile file.
+ */
+
+void emit_profile_runtime() {
+    SAVE;
+    int n = profile_size();
+    emit_noindent(".data");
+    emit(".align 8");
+    emit_noindent(".Lprof:");
+    emit(".zero %d", n * 8);
+    emit_noindent(".Lprof_file:");
+    emit(".string \"%s\"", quote_cstring(profile_file));
+    emit_noindent(".Lprof_mode:");
+    emit(".string \"a\"");
+    emit_noindent(".Lprof_header:");
+    emit(".string \"8cc-profile %d %u\\n\"", n, profile_checksum());
+    emit_noindent(".Lprof_format:");
+    emit(".string \"#ld\\n\"");
+
+    emit_noindent(".text");
+    emit_noindent(".Lprof_dump:");
+    emit("push #rbx");
+    emit("push #r12");
+    emit("push #r13");
+    emit("lea .Lprof_file(#rip), #rdi");
+    emit("lea .Lprof_mode(#rip), #rsi");
+    emit("call fopen");
+    emit("test #rax, #rax");
+    emit("jz .Lprof_done");
+    emit("mov #rax, #rbx");
+    emit("mov #rbx, #rdi");
+    emit("lea .Lprof_header(#rip), #rsi");
+    emit("mov $0, #eax");
+    emit("call fprintf");
+    emit("mov $0, #r12");
+    emit_noindent(".Lprof_loop:");
+    emit("cmp $%d, #r12", n);
+    emit("je .Lprof_close");
+    emit("mov #rbx, #rdi");
+    emit("lea .Lprof_format(#rip), #rsi");
+    emit("lea .Lprof(#rip), #rdx");
+    emit("mov (#rdx,#r12,8), #rdx");
+    emit("mov $0, #eax");
+    emit("call fprintf");
+    emit("add $1, #r12");
+    emit("jmp .Lprof_loop");
+    emit_noindent(".Lprof_close:");
+    emit("mov #rbx, #rdi");
+    emit("call fclose");
+    emit_noindent(".Lprof_done:");
+    emit("pop #r13");
+    emit("pop #r12");
+    emit("pop #rbx");
+    emit("ret");
+
+    emit_atexit(".Lprof_init", ".Lprof_dump");
+}
+
+/*
+ * Cycle table
+ *
+ * Each entry of .Lcycles is the function name, the number of calls and
+ * the number of cycles spent in the function.
+ */
+
+void emit_cycle_table() {
+    SAVE;
+    int n = vec_len(cycle_funcs);
+    emit_noindent(".data");
+    emit(".align 8");
+    emit_noindent(".Lcycles:");
+    for (int i = 0; i < n; i++) {
+        emit(".quad .Lcycles_name%d", i);
+        emit(".quad 0");
+        emit(".quad 0");
+    }
+    for (int i = 0; i < n; i++) {
+        emit_noindent(".Lcycles_name%d:", i);
+        emit(".string \"%s\"", (char *)vec_get(cycle_funcs, i));
+    }
+    emit_noindent(".Lcycles_format:");
+    emit(".string \"#-24s #12ld calls #16ld cycles\\n\"");
+
+    emit_noindent(".text");
+    emit_noindent(".Lcycles_dump:");
+    emit("push #rbx");
+    emit("push #r12");
+    emit("push #r13");
+    emit("lea .Lcycles(#rip), #rbx");
+    emit("mov $0, #r12");
+    emit_noindent(".Lcycles_loop:");
+    emit("cmp $%d, #r12", n);
+    emit("je .Lcycles_done");
+    emit("mov 8(#rbx), #rcx");
+    emit("test #rcx, #rcx");
+    emit("jz .Lcycles_next");
+    emit("mov stderr(#rip), #rdi");
+    emit("lea .Lcycles_format(#rip), #rsi");
+    emit("mov (#rbx), #rdx");
+    emit("mov 16(#rbx), #r8");
+    emit("mov $0, #eax");
+    emit("call fprintf");
+    emit_noindent(".Lcycles_next:");
+    emit("add $24, #rbx");
+    emit("add $1, #r12");
+    emit("jmp .Lcycles_loop");
+    emit_noindent(".Lcycles_done:");
+    emit("pop #r13");
+    emit("pop #r12");
+    emit("pop #rbx");
+    emit("ret");
+    emit_atexit(".Lcycles_init", ".Lcycles_dump");
+}
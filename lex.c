@@ -50,15 +50,19 @@ static char *pos_string(Pos *p) {
 static void skip_block_comment(void);
 
 void lex_init(char *filename) {
-    vec_push(buffers, make_vector());
     if (!strcmp(filename, "-")) {
-        stream_push(make_file(stdin, "-"));
+        lex_init_file(make_file(stdin, "-"));
         return;
     }
     FILE *fp = fopen(filename, "r");
     if (!fp)
         error("Cannot open %s: %s", filename, strerror(errno));
-    stream_push(make_file(fp, filename));
+    lex_init_file(make_file(fp, filename));
+}
+
+void lex_init_file(File *f) {
+    vec_push(buffers, make_vector());
+    stream_push(f);
 }
 
 static Pos get_pos(int delta) {
@@ -70,9 +74,33 @@ static void mark() {
     pos = get_pos(0);
 }
 
+/*
+ * Tokens are never freed, so they are carved out of large chunks
+ * rather than allocated one at a time.
+ */
+
+#define TOKEN_CHUNK 1024
+
+static Token *token_chunk;
+static int token_chunk_left;
+
+static Token *alloc_token() {
+    if (token_chunk_left == 0) {
+        token_chunk = malloc(sizeof(Token) * TOKEN_CHUNK);
+        token_chunk_left = TOKEN_CHUNK;
+    }
+    token_chunk_left--;
+    return token_chunk++;
+}
+
+Token *copy_token(Token *tok) {
+    Token *r = alloc_token();
+    *r = *tok;
+    return r;
+}
+
 static Token *make_token(Token *tmpl) {
-    Token *r = malloc(sizeof(Token));
-    *r = *tmpl;
+    Token *r = copy_token(tmpl);
     r->hideset = NULL;
     File *f = current_file();
     r->file = f;
@@ -165,61 +193,143 @@ static bool skip_space() {
     return true;
 }
 
-static void skip_char() {
-    if (readc() == '\\')
-        readc();
-    int c = readc();
-    while (c != EOF && c != '\'')
-        c = readc();
+/*
+ * Skipping excluded groups
+ *
+ * C11 6.10 says that code within #if and #endif needs to be a sequence of
+ * valid tokens even if skipped. However, in reality, most compilers don't
+ * tokenize nor validate contents. We don't do that, too.
+ *
+ * The functions below skip such code as fast as we can by scanning the
+ * input buffer directly: most lines are passed over with memchr, and
+ * only lines containing a slash or ending with a backslash are looked
+ * at byte by byte to find comments and line continuations. Directive
+ * names are compared in place, without making tokens. Each function
+ * adds the number of newlines it passes to *nline.
+ */
+
+// Skips a block comment. p points just past the opening "/*".
+static char *skip_comment_fast(char *p, char *end, int *nline) {
+    for (; p < end; p++) {
+        if (*p == '\n')
+            (*nline)++;
+        else if (*p == '*' && p + 1 < end && p[1] == '/')
+            return p + 2;
+    }
+    return end;
+}
+
+// Skips spaces, comments and line continuations within a line.
+static char *skip_space_fast(char *p, char *end, int *nline) {
+    while (p < end) {
+        if (iswhitespace(*p)) {
+            p++;
+        } else if (p + 1 < end && p[0] == '/' && p[1] == '*') {
+            p = skip_comment_fast(p + 2, end, nline);
+        } else if (p + 1 < end && p[0] == '\\' && p[1] == '\n') {
+            p += 2;
+            (*nline)++;
+        } else {
+            break;
+        }
+    }
+    return p;
 }
 
-static void skip_string() {
-    for (int c = readc(); c != EOF && c != '"'; c = readc())
-        if (c == '\\')
-            readc();
+// Skips a character or string literal. p points just past the opening
+// quote. An unterminated literal ends at the end of the line.
+static char *skip_literal_fast(char *p, char *end, char quote, int *nline) {
+    while (p < end && *p != quote && *p != '\n') {
+        if (*p == '\\' && p + 1 < end) {
+            if (p[1] == '\n')
+                (*nline)++;
+            p++;
+        }
+        p++;
+    }
+    return (p < end && *p == quote) ? p + 1 : p;
 }
 
-// Skips a block of code excluded from input by #if, #ifdef and the like.
-// C11 6.10 says that code within #if and #endif needs to be a sequence of
-// valid tokens even if skipped. However, in reality, most compilers don't
-// tokenize nor validate contents. We don't do that, too.
-// This function is to skip code until matching #endif as fast as we can.
-void skip_cond_incl() {
-    int nest = 0;
-    for (;;) {
-        bool bol = (current_file()->column == 1);
-        skip_space();
-        int c = readc();
-        if (c == EOF)
-            return;
-        if (c == '\'') {
-            skip_char();
-            continue;
+// Returns the beginning of the next line.
+static char *skip_line_fast(char *p, char *end, int *nline) {
+    char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+        return end;
+    if (!memchr(p, '/', nl - p) && (nl == p || nl[-1] != '\\')) {
+        (*nline)++;
+        return nl + 1;
+    }
+    bool in_comment = false; // in a "//" comment
+    while (p < end) {
+        char c = *p++;
+        if (c == '\n') {
+            (*nline)++;
+            return p;
         }
-        if (c == '\"') {
-            skip_string();
+        if (c == '\\' && p < end && *p == '\n') {
+            p++;
+            (*nline)++;
+        } else if (in_comment) {
             continue;
+        } else if (c == '/' && p < end && *p == '*') {
+            p = skip_comment_fast(p + 1, end, nline);
+        } else if (c == '/' && p < end && *p == '/') {
+            in_comment = true;
+        } else if (c == '"' || c == '\'') {
+            p = skip_literal_fast(p, end, c, nline);
         }
-        if (c != '#' || !bol)
-            continue;
-        int column = current_file()->column - 1;
-        Token *tok = lex();
-        if (tok->kind != TIDENT)
-            continue;
-        if (!nest && (is_ident(tok, "else") || is_ident(tok, "elif") || is_ident(tok, "endif"))) {
-            unget_token(tok);
-            Token *hash = make_keyword('#');
-            hash->bol = true;
-            hash->column = column;
-            unget_token(hash);
-            return;
+    }
+    return end;
+}
+
+static bool is_directive(char *p, int len, char *name) {
+    return len == strlen(name) && !strncmp(p, name, len);
+}
+
+// Skips a block of code excluded from input by #if, #ifdef and the like,
+// up to the matching #else, #elif or #endif, which is left in the input.
+void skip_cond_incl() {
+    File *f = current_file();
+    // Characters pushed back to the stream are part of the current line.
+    bool bol = (f->column == 1);
+    while (f->buflen > 0)
+        bol = (readc() == '\n');
+    char *end = f->data ? f->data + f->size : f->p + strlen(f->p);
+    char *p = f->p;
+    int nline = 0;
+    int nest = 0;
+    if (!bol)
+        p = skip_line_fast(p, end, &nline);
+    while (p < end) {
+        char *line_start = p;
+        int line = nline;
+        p = skip_space_fast(p, end, &nline);
+        if (p < end && *p == '#') {
+            p = skip_space_fast(p + 1, end, &nline);
+            char *name = p;
+            while (p < end && (isalnum(*p) || *p == '_'))
+                p++;
+            int len = p - name;
+            if (!nest && (is_directive(name, len, "else") || is_directive(name, len, "elif") ||
+                          is_directive(name, len, "endif"))) {
+                // Let the lexer read the directive from the beginning of the line.
+                p = line_start;
+                nline = line;
+                break;
+            }
+            if (is_directive(name, len, "if") || is_directive(name, len, "ifdef") ||
+                is_directive(name, len, "ifndef"))
+                nest++;
+            else if (nest && is_directive(name, len, "endif"))
+                nest--;
         }
-        if (is_ident(tok, "if") || is_ident(tok, "ifdef") || is_ident(tok, "ifndef"))
-            nest++;
-        else if (nest && is_ident(tok, "endif"))
-            nest--;
-        skip_line();
+        p = skip_line_fast(p, end, &nline);
     }
+    if (p != f->p)
+        f->last = p[-1];
+    f->p = p;
+    f->line += nline;
+    f->column = 1;
 }
 
 // Reads a number literal. Lexer's grammar on numbers is not strict.
@@ -593,6 +703,18 @@ Token *lex_string(char *s) {
     return r;
 }
 
+// Returns the pushed-back tokens and resets them, so that another input
+// can be read. lex_restore() switches back.
+void *lex_save() {
+    Vector *r = buffers;
+    buffers = make_vector();
+    return r;
+}
+
+void lex_restore(void *state) {
+    buffers = state;
+}
+
 Token *lex() {
     Vector *buf = vec_tail(buffers);
     if (vec_len(buf) > 0)
@@ -0,0 +1,183 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+/*
+ * This is a library interface to the preprocessor, for tools that scan
+ * source files, such as dependency scanners and code indexers. It is
+ * built as libcpp.a.
+ *
+ *   Preprocessor *pp = pp_new();
+ *   pp_add_include_path(pp, "include");
+ *   pp_define(pp, "NDEBUG");
+ *   if (pp_open_file(pp, "foo.c") < 0)
+ *       ... pp_error(pp) ...
+ *   Token *buf[256];
+ *   int n;
+ *   while ((n = pp_read(pp, buf, 256)) > 0)
+ *       ...
+ *
+ * The preprocessor keeps its state in global variables. A Preprocessor
+ * owns a copy of that state, and each function below first swaps in the
+ * state of the Preprocessor it is given, so any number of them can be
+ * used in turn and in any order. They can't be used from more than one
+ * thread at a time.
+ *
+ * Errors don't terminate the process. A function that fails returns -1
+ * or NULL, and pp_error() returns the message. The Preprocessor can't be
+ * used after that.
+ *
+ * As in the rest of the compiler, memory is never freed.
+ */
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+struct Preprocessor {
+    char *name;       // the input file name
+    Buffer *defs;     // #define and #undef lines from pp_define and pp_undef
+    void *file_state; // saved state while another Preprocessor is active
+    void *lex_state;
+    void *cpp_state;
+    bool opened;
+    bool eof;
+    char *error;
+};
+
+static Preprocessor *active;
+
+char *get_base_file() {
+    return active ? active->name : NULL;
+}
+
+static void activate(Preprocessor *pp) {
+    if (pp == active)
+        return;
+    if (active) {
+        active->file_state = stream_save();
+        active->lex_state = lex_save();
+        active->cpp_state = cpp_save();
+    }
+    active = pp;
+    // A new Preprocessor starts from the state that was just reset.
+    if (pp->cpp_state) {
+        stream_restore(pp->file_state);
+        lex_restore(pp->lex_state);
+        cpp_restore(pp->cpp_state);
+    }
+}
+
+static int fail(Preprocessor *pp) {
+    error_jmp = NULL;
+    pp->error = error_message;
+    return -1;
+}
+
+Preprocessor *pp_new() {
+    Preprocessor *r = calloc(1, sizeof(Preprocessor));
+    r->defs = make_buffer();
+    return r;
+}
+
+// Include paths and macros must be given before the input is opened.
+void pp_add_include_path(Preprocessor *pp, char *dir) {
+    activate(pp);
+    add_include_path(dir);
+}
+
+// Defines a macro as -D does; def is "name" or "name=value".
+void pp_define(Preprocessor *pp, char *def) {
+    char *s = strdup(def);
+    char *p = strchr(s, '=');
+    if (p)
+        *p = ' ';
+    buf_printf(pp->defs, "#define %s\n", s);
+}
+
+void pp_undef(Preprocessor *pp, char *name) {
+    buf_printf(pp->defs, "#undef %s\n", name);
+}
+
+static void start(Preprocessor *pp) {
+    if (pp->opened)
+        error("%s: input is already open", pp->name);
+    cpp_init_standalone();
+    if (buf_len(pp->defs) > 0)
+        cpp_read_from_string(buf_body(pp->defs));
+    pp->opened = true;
+}
+
+int pp_open_file(Preprocessor *pp, char *path) {
+    if (pp->error)
+        return -1;
+    activate(pp);
+    jmp_buf env;
+    if (setjmp(env))
+        return fail(pp);
+    error_jmp = &env;
+    if (!pp->opened) {
+        pp->name = path;
+        lex_init(path);
+    }
+    start(pp);
+    error_jmp = NULL;
+    return 0;
+}
+
+// Preprocesses a NUL-terminated string as if it were the contents of
+// the named file.
+int pp_open_buffer(Preprocessor *pp, char *name, char *buf) {
+    if (pp->error)
+        return -1;
+    activate(pp);
+    jmp_buf env;
+    if (setjmp(env))
+        return fail(pp);
+    error_jmp = &env;
+    if (!pp->opened) {
+        pp->name = name;
+        File *f = make_file_string(buf);
+        f->name = name;
+        lex_init_file(f);
+    }
+    start(pp);
+    error_jmp = NULL;
+    return 0;
+}
+
+// Stores up to n tokens into buf, and returns the number of tokens
+// stored, 0 at the end of input, or -1 on error.
+int pp_read(Preprocessor *pp, Token **buf, int n) {
+    if (pp->error)
+        return -1;
+    activate(pp);
+    jmp_buf env;
+    if (setjmp(env))
+        return fail(pp);
+    error_jmp = &env;
+    if (!pp->opened)
+        error("no input is open");
+    int i = 0;
+    while (i < n && !pp->eof) {
+        Token *tok = read_token();
+        if (tok->kind == TEOF)
+            pp->eof = true;
+        else
+            buf[i++] = tok;
+    }
+    error_jmp = NULL;
+    return i;
+}
+
+// Returns the names of the headers included so far, as -M would list
+// them. System headers are included if system is true.
+Vector *pp_dependencies(Preprocessor *pp, bool system) {
+    if (pp->error)
+        return NULL;
+    activate(pp);
+    return header_dependencies(system);
+}
+
+char *pp_error(Preprocessor *pp) {
+    return pp->error;
+}
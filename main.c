@@ -1,5 +1,6 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <errno.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,12 @@ static bool dumpast;
 static bool cpponly;
 static bool dumpasm;
 static bool dontlink;
+static bool gendeps;
+static bool depsonly;
+static bool depsystem;
+static bool depphony;
+static char *depfile;
+static char *deptarget;
 static Buffer *cppdefs;
 static Vector *tmpfiles = &EMPTY_VECTOR;
 
@@ -24,19 +31,37 @@ static void usage(int exitcode) {
             "\n"
             "  -I<path>          add to include path\n"
             "  -E                print preprocessed source code\n"
+            "  -P                Do not print line markers with -E\n"
             "  -D name           Predefine name as a macro\n"
             "  -D name=def\n"
             "  -S                Stop before assembly (default)\n"
             "  -c                Do not run linker (default)\n"
             "  -U name           Undefine name\n"
+            "  -M                Print a Makefile rule listing the included headers\n"
+            "  -MM               Like -M, but omit system headers\n"
+            "  -MD, -MMD         Like -M and -MM, but also compile\n"
+            "  -MF file          Write the rule to the specified file\n"
+            "  -MT target        Use target as the rule's target\n"
+            "  -MP               Add a phony target for each header\n"
             "  -fdump-ast        print AST\n"
             "  -fdump-stack      Print stacktrace\n"
             "  -fno-dump-source  Do not emit source code as assembly comment\n"
+            "  -finclude-stats   Print include path lookup statistics\n"
+            "  -fmacro-report[=N]\n"
+            "                    Print the N costliest macros and headers (default 20)\n"
+            "  -finstrument-functions\n"
+            "                    Call __cyg_profile_func_enter/exit hooks\n"
+            "  -finstrument-functions=cycles\n"
+            "                    Print cycles spent in each function at exit\n"
+            "  -fprofile-generate[=file]\n"
+            "                    Instrument code to write a profile at exit\n"
+            "  -fprofile-use[=file]\n"
+            "                    Optimize using the profile\n"
             "  -o filename       Output to the specified file\n"
-            "  -g                Do nothing at this moment\n"
+            "  -g                Generate debug information\n"
             "  -Wall             Enable all warnings\n"
             "  -Werror           Make all warnings into errors\n"
-            "  -O<number>        Does nothing at this moment\n"
+            "  -O<number>        Optimization level (-O0 disables optimizations)\n"
             "  -m64              Output 64-bit code (default)\n"
             "  -w                Disable all warnings\n"
             "  -h                print this help\n"
@@ -80,6 +105,29 @@ static FILE *open_asmfile() {
     return fp;
 }
 
+// Replaces the extension of the file name, if any, with the given one.
+static char *replace_ext(char *filename, char *ext) {
+    char *path = format("%s", filename);
+    char *dot = strrchr(base(path), '.');
+    if (dot)
+        path[strlen(path) - strlen(dot)] = '\0';
+    return format("%s.%s", path, ext);
+}
+
+// The profile of foo.c is foo.prof. The path is made absolute because
+// the instrumented program may run in another directory.
+static char *default_profile_file() {
+    if (!strcmp(infile, "-"))
+        error("-fprofile-generate and -fprofile-use need a file name for stdin");
+    char *path = replace_ext(infile, "prof");
+    if (path[0] == '/')
+        return path;
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        perror("getcwd");
+    return format("%s/%s", cwd, path);
+}
+
 static void parse_warnings_arg(char *s) {
     if (!strcmp(s, "error"))
         warning_is_error = true;
@@ -92,12 +140,56 @@ static void parse_f_arg(char *s) {
         dumpast = true;
     else if (!strcmp(s, "dump-stack"))
         dumpstack = true;
+    else if (!strcmp(s, "include-stats"))
+        include_stats = true;
     else if (!strcmp(s, "no-dump-source"))
         dumpsource = false;
-    else
+    else if (!strcmp(s, "instrument-functions"))
+        instrument_functions = true;
+    else if (!strcmp(s, "instrument-functions=cycles"))
+        instrument_cycles = true;
+    else if (!strcmp(s, "profile-generate"))
+        profile_generate = true;
+    else if (!strcmp(s, "profile-use"))
+        profile_use = true;
+    else if (!strncmp(s, "profile-generate=", 17)) {
+        profile_generate = true;
+        profile_file = s + 17;
+    } else if (!strncmp(s, "profile-use=", 12)) {
+        profile_use = true;
+        profile_file = s + 12;
+    } else if (!strcmp(s, "macro-report")) {
+        macro_report = true;
+    } else if (!strncmp(s, "macro-report=", 13)) {
+        macro_report = true;
+        macro_report_limit = atoi(s + 13);
+    } else
         usage(1);
 }
 
+// -M, -MM, -MD, -MMD, -MF file, -MT target and -MP.
+static void parse_dep_arg(char *s, int argc, char **argv) {
+    if (!s || !strcmp(s, "M")) {
+        gendeps = depsonly = cpponly = true;
+        depsystem = !s;
+    } else if (!strcmp(s, "D") || !strcmp(s, "MD")) {
+        gendeps = true;
+        depsystem = (s[0] == 'D');
+    } else if (s[0] == 'F' || s[0] == 'T') {
+        char *arg = s[1] ? s + 1 : (optind < argc) ? argv[optind++] : NULL;
+        if (!arg)
+            error("missing argument to -M%c", s[0]);
+        if (s[0] == 'F')
+            depfile = arg;
+        else
+            deptarget = deptarget ? format("%s %s", deptarget, arg) : arg;
+    } else if (!strcmp(s, "P")) {
+        depphony = true;
+    } else {
+        error("unknown -M option: -M%s", s);
+    }
+}
+
 static void parse_m_arg(char *s) {
     if (strcmp(s, "64"))
         error("Only 64 is allowed for -m, but got %s", s);
@@ -106,7 +198,7 @@ static void parse_m_arg(char *s) {
 static void parseopt(int argc, char **argv) {
     cppdefs = make_buffer();
     for (;;) {
-        int opt = getopt(argc, argv, "I:ED:O:SU:W:acd:f:gm:o:hw");
+        int opt = getopt(argc, argv, "I:ED:M::O:PSU:W:acd:f:gm:o:hw");
         if (opt == -1)
             break;
         switch (opt) {
@@ -119,7 +211,9 @@ static void parseopt(int argc, char **argv) {
             buf_printf(cppdefs, "#define %s\n", optarg);
             break;
         }
-        case 'O': break;
+        case 'M': parse_dep_arg(optarg, argc, argv); break;
+        case 'O': optlevel = atoi(optarg); break;
+        case 'P': linemarkers = false; break;
         case 'S': dumpasm = true; break;
         case 'U':
             buf_printf(cppdefs, "#undef %s\n", optarg);
@@ -128,7 +222,7 @@ static void parseopt(int argc, char **argv) {
         case 'c': dontlink = true; break;
         case 'f': parse_f_arg(optarg); break;
         case 'm': parse_m_arg(optarg); break;
-        case 'g': break;
+        case 'g': debug_info = true; break;
         case 'o': outfile = optarg; break;
         case 'w': enable_warning = false; break;
         case 'h':
@@ -143,24 +237,80 @@ static void parseopt(int argc, char **argv) {
     if (!dumpast && !cpponly && !dumpasm && !dontlink)
         error("One of -a, -c, -E or -S must be specified");
     infile = argv[optind];
+    if (profile_generate && profile_use)
+        error("-fprofile-generate and -fprofile-use are mutually exclusive");
+    if ((profile_generate || profile_use) && !profile_file)
+        profile_file = default_profile_file();
 }
 
 char *get_base_file() {
     return infile;
 }
 
+/*
+ * Dependency output
+ */
+
+static void buf_write_dep(Buffer *b, char *path) {
+    for (char *p = path; *p; p++) {
+        if (*p == ' ' || *p == '#')
+            buf_write(b, '\\');
+        else if (*p == '$')
+            buf_write(b, '$');
+        buf_write(b, *p);
+    }
+}
+
+// Writes a Makefile rule saying that the output depends on the input
+// file and all headers it included.
+static void write_dep_file() {
+    bool has_outfile = outfile && strcmp(outfile, "-");
+    char *target = deptarget;
+    if (!target)
+        target = (has_outfile && !depsonly) ? outfile : replace_ext(base(infile), "o");
+    char *path = depfile;
+    if (!path && depsonly)
+        path = has_outfile ? outfile : "-";
+    if (!path)
+        path = replace_ext((has_outfile && !cpponly) ? outfile : base(infile), "d");
+
+    Vector *headers = header_dependencies(depsystem);
+    Buffer *b = make_buffer();
+    buf_printf(b, "%s: ", target);
+    buf_write_dep(b, infile);
+    for (int i = 0; i < vec_len(headers); i++) {
+        buf_printf(b, " \\\n  ");
+        buf_write_dep(b, vec_get(headers, i));
+    }
+    buf_printf(b, "\n");
+    for (int i = 0; depphony && i < vec_len(headers); i++) {
+        buf_printf(b, "\n");
+        buf_write_dep(b, vec_get(headers, i));
+        buf_printf(b, ":\n");
+    }
+
+    FILE *fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!fp)
+        error("cannot open %s: %s", path, strerror(errno));
+    fwrite(buf_body(b), 1, buf_len(b), fp);
+    if (fp != stdout)
+        fclose(fp);
+}
+
 static void preprocess() {
-    for (;;) {
-        Token *tok = read_token();
-        if (tok->kind == TEOF)
-            break;
-        if (tok->bol)
-            printf("\n");
-        if (tok->space)
-            printf(" ");
-        printf("%s", tok2s(tok));
+    if (depsonly) {
+        while (read_token()->kind != TEOF);
+    } else if (outfile && strcmp(outfile, "-")) {
+        FILE *fp = fopen(outfile, "w");
+        if (!fp)
+            error("cannot open %s: %s", outfile, strerror(errno));
+        write_preprocessed(fp);
+        fclose(fp);
+    } else {
+        write_preprocessed(stdout);
     }
-    printf("\n");
+    if (gendeps)
+        write_dep_file();
     exit(0);
 }
 
@@ -169,6 +319,10 @@ int main(int argc, char **argv) {
     if (atexit(delete_temp_files))
         perror("atexit");
     parseopt(argc, argv);
+    if (include_stats && atexit(print_include_stats))
+        perror("atexit");
+    if (macro_report && atexit(print_macro_report))
+        perror("atexit");
     lex_init(infile);
     cpp_init();
     parse_init();
@@ -180,6 +334,8 @@ int main(int argc, char **argv) {
         preprocess();
 
     Vector *toplevels = read_toplevels();
+    if (!dumpast)
+        toplevels = optimize(toplevels);
     for (int i = 0; i < vec_len(toplevels); i++) {
         Node *v = vec_get(toplevels, i);
         if (dumpast)
@@ -187,6 +343,14 @@ int main(int argc, char **argv) {
         else
             emit_toplevel(v);
     }
+    if (!dumpast && profile_generate)
+        emit_profile_runtime();
+    if (!dumpast && instrument_cycles)
+        emit_cycle_table();
+    if (!dumpast && debug_info)
+        emit_debug_info();
+    if (gendeps)
+        write_dep_file();
 
     close_output_file();
 
@@ -0,0 +1,1150 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+/*
+ * AST-level optimizer.
+ *
+ * The passes in this file rewrite the AST between the parser and the
+ * code generator. The code generator is a simple stack machine, so we
+ * get most of the benefit by making the tree smaller before it sees it.
+ * All passes are skipped with -O0.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+int optlevel = 1;
+
+/*
+ * Traversal
+ */
+
+typedef void Visitor(Node **p, void *arg);
+
+static void visit_vec(Vector *vec, Visitor *fn, void *arg) {
+    if (!vec)
+        return;
+    Node **body = vec_body(vec);
+    for (int i = 0; i < vec_len(vec); i++)
+        fn(&body[i], arg);
+}
+
+static void visit(Node **p, Visitor *fn, void *arg) {
+    if (*p)
+        fn(p, arg);
+}
+
+// Calls fn for each child of the node. Because fn receives the address of
+// the field that holds a child, it can replace the child with a new node.
+static void visit_children(Node *node, Visitor *fn, void *arg) {
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_GVAR:
+    case AST_TYPEDEF:
+    case AST_FUNCDESG:
+    case AST_GOTO:
+    case AST_LABEL:
+    case OP_LABEL_ADDR:
+        return;
+    case AST_LVAR:
+        visit_vec(node->lvarinit, fn, arg);
+        return;
+    case AST_FUNCALL:
+        visit_vec(node->args, fn, arg);
+        return;
+    case AST_FUNCPTR_CALL:
+        visit(&node->fptr, fn, arg);
+        visit_vec(node->args, fn, arg);
+        return;
+    case AST_FUNC:
+        visit(&node->body, fn, arg);
+        return;
+    case AST_DECL:
+        visit(&node->declvar, fn, arg);
+        visit_vec(node->declinit, fn, arg);
+        return;
+    case AST_INIT:
+        visit(&node->initval, fn, arg);
+        return;
+    case AST_CONV:
+    case AST_ADDR:
+    case AST_DEREF:
+    case AST_COMPUTED_GOTO:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        visit(&node->operand, fn, arg);
+        return;
+    case AST_IF:
+    case AST_TERNARY:
+        visit(&node->cond, fn, arg);
+        visit(&node->then, fn, arg);
+        visit(&node->els, fn, arg);
+        return;
+    case AST_RETURN:
+        visit(&node->retval, fn, arg);
+        return;
+    case AST_COMPOUND_STMT:
+        visit_vec(node->stmts, fn, arg);
+        return;
+    case AST_STRUCT_REF:
+        visit(&node->struc, fn, arg);
+        return;
+    default:
+        visit(&node->left, fn, arg);
+        visit(&node->right, fn, arg);
+    }
+}
+
+/*
+ * Function inlining
+ *
+ * A call to a small static function is replaced with a copy of the
+ * callee's body. Parameters become fresh local variables of the caller
+ * that are initialized with the arguments, so each argument is evaluated
+ * exactly once. The body must be convertible to an expression: a
+ * sequence of statements ending with "return", optionally branching with
+ * "if". Functions with labels (and hence loops or switch), varargs, or
+ * frame-dependent builtins are never inlined.
+ */
+
+#define INLINE_LIMIT 40         // max size of a static function to inline
+#define INLINE_LIMIT_HINT 120   // max size of a static inline function
+#define INLINE_GROWTH 1500      // max number of nodes added to a function
+#define INLINE_DEPTH 4
+
+typedef struct {
+    Node *func;       // the function we are inlining into
+    Vector *stack;    // functions being inlined, to stop recursion
+    int growth;
+    int depth;
+} Inliner;
+
+typedef struct {
+    int size;
+    bool unsafe;
+} BodyInfo;
+
+static Map *funcs;    // static function name -> AST_FUNC
+static Map *fsize;    // static function name -> size, or -1 if not inlinable
+
+static void body_info(Node **p, void *arg) {
+    Node *node = *p;
+    BodyInfo *info = arg;
+    info->size++;
+    switch (node->kind) {
+    case AST_LABEL:
+    case AST_GOTO:
+    case AST_COMPUTED_GOTO:
+    case OP_LABEL_ADDR:
+        info->unsafe = true;
+        return;
+    case AST_FUNCALL:
+        if (!strcmp(node->fname, "__builtin_return_address") ||
+            !strcmp(node->fname, "__builtin_va_start"))
+            info->unsafe = true;
+        break;
+    }
+    visit_children(node, body_info, arg);
+}
+
+static int node_size(Node *node) {
+    BodyInfo info = { 0, false };
+    body_info(&node, &info);
+    return info.size;
+}
+
+static void find_return(Node **p, void *arg) {
+    if ((*p)->kind == AST_RETURN)
+        *(bool *)arg = true;
+    else
+        visit_children(*p, find_return, arg);
+}
+
+static bool has_return(Node *node) {
+    bool r = false;
+    find_return(&node, &r);
+    return r;
+}
+
+static int inlinable_size(Node *func) {
+    Type *ty = func->ty;
+    if (ty->hasva || ty->oldstyle || ty->rettype->kind == KIND_STRUCT)
+        return -1;
+    for (int i = 0; i < vec_len(func->params); i++) {
+        Node *param = vec_get(func->params, i);
+        if (param->ty->kind == KIND_STRUCT)
+            return -1;
+    }
+    BodyInfo info = { 0, false };
+    body_info(&func->body, &info);
+    if (info.unsafe)
+        return -1;
+    // With a profile, hot functions get the same budget as those
+    // declared inline, and functions that never ran are left alone.
+    int hotness = func_hotness(func);
+    if (hotness < 0)
+        return -1;
+    int limit = (ty->isinline || hotness > 0) ? INLINE_LIMIT_HINT : INLINE_LIMIT;
+    if (info.size > limit)
+        return -1;
+    return info.size;
+}
+
+// Returns the size of the function body, or -1 if we shouldn't inline it.
+static int get_size(Node *func) {
+    intptr_t r = (intptr_t)map_get(fsize, func->fname);
+    if (r == 0) {
+        r = inlinable_size(func);
+        map_put(fsize, func->fname, (void *)(r + 1));
+        return r;
+    }
+    return r - 1;
+}
+
+// Maps the callee's local variables to the caller's.
+typedef struct {
+    Vector *from;
+    Vector *to;
+} VarMap;
+
+static void clone_child(Node **p, void *arg);
+
+static Node *clone(Node *node, VarMap *vars) {
+    if (node->kind == AST_LVAR) {
+        for (int i = 0; i < vec_len(vars->from); i++)
+            if (vec_get(vars->from, i) == node)
+                return vec_get(vars->to, i);
+        return node;
+    }
+    if (node->kind == AST_GVAR)
+        return node;
+    Node *r = copy_node(node);
+    switch (r->kind) {
+    case AST_FUNCALL:
+    case AST_FUNCPTR_CALL:
+        r->args = vec_copy(r->args);
+        break;
+    case AST_DECL:
+        if (r->declinit)
+            r->declinit = vec_copy(r->declinit);
+        break;
+    case AST_COMPOUND_STMT:
+        r->stmts = vec_copy(r->stmts);
+        break;
+    }
+    visit_children(r, clone_child, vars);
+    return r;
+}
+
+static void clone_child(Node **p, void *arg) {
+    *p = clone(*p, arg);
+}
+
+static Node *make_compound(Type *ty, Vector *stmts) {
+    return copy_node(&(Node){ AST_COMPOUND_STMT, .ty = ty, .stmts = stmts });
+}
+
+static Node *seq_to_expr(Vector *stmts, int i, Type *rettype, VarMap *vars);
+
+static Node *stmt_to_expr(Node *stmt, Vector *rest, int i, Type *rettype, VarMap *vars) {
+    Vector *seq = make_vector();
+    if (stmt) {
+        if (stmt->kind == AST_COMPOUND_STMT && !stmt->ty)
+            vec_append(seq, stmt->stmts);
+        else
+            vec_push(seq, stmt);
+    }
+    for (; i < vec_len(rest); i++)
+        vec_push(seq, vec_get(rest, i));
+    return seq_to_expr(seq, 0, rettype, vars);
+}
+
+// Converts statements to an expression that computes the return value.
+// Returns NULL if it's not possible.
+static Node *seq_to_expr(Vector *stmts, int i, Type *rettype, VarMap *vars) {
+    Vector *r = make_vector();
+    for (; i < vec_len(stmts); i++) {
+        Node *stmt = vec_get(stmts, i);
+        if (!has_return(stmt)) {
+            vec_push(r, clone(stmt, vars));
+            continue;
+        }
+        if (stmt->kind == AST_RETURN) {
+            if (stmt->retval)
+                vec_push(r, clone(stmt->retval, vars));
+            return make_compound(rettype, r);
+        }
+        if (stmt->kind == AST_COMPOUND_STMT && !stmt->ty)
+            return stmt_to_expr(stmt, stmts, i + 1, rettype, vars);
+        if (stmt->kind != AST_IF)
+            return NULL;
+        Node *then = stmt_to_expr(stmt->then, stmts, i + 1, rettype, vars);
+        Node *els = stmt_to_expr(stmt->els, stmts, i + 1, rettype, vars);
+        if (!then || !els)
+            return NULL;
+        Node *tern = copy_node(stmt);
+        tern->kind = AST_TERNARY;
+        tern->ty = rettype;
+        tern->cond = clone(stmt->cond, vars);
+        tern->then = then;
+        tern->els = els;
+        vec_push(r, tern);
+        return make_compound(rettype, r);
+    }
+    // Falling off the end of a non-void function is undefined.
+    if (rettype->kind != KIND_VOID)
+        return NULL;
+    return make_compound(rettype, r);
+}
+
+static Node *new_lvar(Inliner *in, Node *var) {
+    Node *r = copy_node(var);
+    r->lvarinit = NULL;
+    vec_push(in->func->localvars, r);
+    return r;
+}
+
+static void inline_calls(Node **p, void *arg);
+
+static Node *inline_call(Inliner *in, Node *call, Node *callee) {
+    VarMap vars = { make_vector(), make_vector() };
+    Vector *stmts = make_vector();
+    for (int i = 0; i < vec_len(callee->params); i++) {
+        Node *param = vec_get(callee->params, i);
+        Node *var = new_lvar(in, param);
+        vec_push(vars.from, param);
+        vec_push(vars.to, var);
+        vec_push(stmts, copy_node(&(Node){
+            '=', call->loc, var->ty, .left = var, .right = vec_get(call->args, i) }));
+    }
+    for (int i = 0; i < vec_len(callee->localvars); i++) {
+        Node *v = vec_get(callee->localvars, i);
+        vec_push(vars.from, v);
+        vec_push(vars.to, new_lvar(in, v));
+    }
+    // Initializers of compound literals may refer to other variables.
+    for (int i = 0; i < vec_len(callee->localvars); i++) {
+        Node *v = vec_get(callee->localvars, i);
+        if (!v->lvarinit)
+            continue;
+        Node *var = vec_get(vars.to, vec_len(callee->params) + i);
+        var->lvarinit = vec_copy(v->lvarinit);
+        visit_vec(var->lvarinit, clone_child, &vars);
+    }
+    Type *rettype = callee->ty->rettype;
+    Node *body = seq_to_expr(callee->body->stmts, 0, rettype, &vars);
+    if (!body)
+        return NULL;
+    // The inlined body may contain calls that can be inlined too.
+    vec_push(in->stack, callee);
+    in->depth++;
+    visit(&body, inline_calls, in);
+    in->depth--;
+    vec_pop(in->stack);
+    vec_append(stmts, body->stmts);
+    Node *r = make_compound(rettype, stmts);
+    r->loc = call->loc;
+    return r;
+}
+
+static bool in_stack(Vector *stack, Node *func) {
+    for (int i = 0; i < vec_len(stack); i++)
+        if (vec_get(stack, i) == func)
+            return true;
+    return false;
+}
+
+static Node *maybe_inline(Inliner *in, Node *call) {
+    Node *callee = map_get(funcs, call->fname);
+    if (!callee || callee == in->func || in_stack(in->stack, callee))
+        return NULL;
+    if (vec_len(call->args) != vec_len(callee->params))
+        return NULL;
+    if (in->depth >= INLINE_DEPTH)
+        return NULL;
+    int size = get_size(callee);
+    if (size < 0 || in->growth + size > INLINE_GROWTH)
+        return NULL;
+    Node *r = inline_call(in, call, callee);
+    if (!r)
+        return NULL;
+    in->growth += node_size(r);
+    return r;
+}
+
+static void inline_calls(Node **p, void *arg) {
+    Node *node = *p;
+    visit_children(node, inline_calls, arg);
+    if (node->kind != AST_FUNCALL)
+        return;
+    Node *r = maybe_inline(arg, node);
+    if (r)
+        *p = r;
+}
+
+static void inline_functions(Vector *toplevels) {
+    funcs = make_map();
+    fsize = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC && v->ty->isstatic)
+            map_put(funcs, v->fname, v);
+    }
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        Inliner in = { v, make_vector(), 0, 0 };
+        visit(&v->body, inline_calls, &in);
+    }
+}
+
+/*
+ * Dead code elimination
+ *
+ * Statements after return or goto are removed unless they contain a
+ * label, and so do the untaken branches of if statements and conditional
+ * expressions with a constant condition, which are common in code
+ * configured by macros. Static functions and variables that cannot be
+ * reached from any non-static definition are dropped from the output.
+ */
+
+static void find_label(Node **p, void *arg) {
+    if ((*p)->kind == AST_LABEL)
+        *(bool *)arg = true;
+    else
+        visit_children(*p, find_label, arg);
+}
+
+static bool has_label(Node *node) {
+    bool r = false;
+    if (node)
+        find_label(&node, &r);
+    return r;
+}
+
+// Returns true if control never reaches the end of the statement.
+static bool is_jump(Node *node) {
+    switch (node->kind) {
+    case AST_RETURN:
+    case AST_GOTO:
+    case AST_COMPUTED_GOTO:
+        return true;
+    case AST_COMPOUND_STMT:
+        return vec_len(node->stmts) > 0 && is_jump(vec_tail(node->stmts));
+    case AST_IF:
+        return node->then && node->els && is_jump(node->then) && is_jump(node->els);
+    }
+    return false;
+}
+
+static bool is_const(Node *node, long *val) {
+    if (node->kind == AST_LITERAL && is_inttype(node->ty)) {
+        *val = node->ival;
+        return true;
+    }
+    if (node->kind == '!' && is_const(node->operand, val)) {
+        *val = !*val;
+        return true;
+    }
+    return false;
+}
+
+static void remove_stmts(Node *node) {
+    Vector *stmts = make_vector();
+    bool dead = false;
+    for (int i = 0; i < vec_len(node->stmts); i++) {
+        Node *stmt = vec_get(node->stmts, i);
+        if (dead && !has_label(stmt))
+            continue;
+        vec_push(stmts, stmt);
+        dead = is_jump(stmt);
+    }
+    node->stmts = stmts;
+}
+
+static void eliminate(Node **p, void *arg) {
+    Node *node = *p;
+    visit_children(node, eliminate, arg);
+    long val;
+    switch (node->kind) {
+    case AST_COMPOUND_STMT:
+        remove_stmts(node);
+        return;
+    case AST_IF:
+    case AST_TERNARY: {
+        if (!is_const(node->cond, &val))
+            return;
+        if (node->kind == AST_TERNARY && !node->then)
+            return;
+        Node *live = val ? node->then : node->els;
+        if (has_label(val ? node->els : node->then))
+            return;
+        *p = live ? live : make_compound(NULL, make_vector());
+        return;
+    }
+    case OP_LOGAND:
+    case OP_LOGOR:
+        if (!is_const(node->left, &val) || has_label(node->right))
+            return;
+        if ((node->kind == OP_LOGAND) == (val == 0)) {
+            Node *r = copy_node(node->left);
+            r->ty = type_int;
+            r->ival = (val != 0);
+            *p = r;
+        }
+        return;
+    }
+}
+
+static char *toplevel_name(Node *v) {
+    return (v->kind == AST_FUNC) ? v->fname : v->declvar->glabel;
+}
+
+static bool is_static(Node *v) {
+    return (v->kind == AST_FUNC) ? v->ty->isstatic : v->declvar->ty->isstatic;
+}
+
+static void find_refs(Node **p, void *arg) {
+    Node *node = *p;
+    switch (node->kind) {
+    case AST_FUNCALL:
+    case AST_FUNCDESG:
+        vec_push(arg, node->fname);
+        break;
+    case AST_GVAR:
+        vec_push(arg, node->glabel);
+        break;
+    }
+    visit_children(node, find_refs, arg);
+}
+
+static Vector *remove_unused(Vector *toplevels) {
+    Map *defs = make_map();
+    Vector *worklist = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        char *name = toplevel_name(v);
+        Vector *vs = map_get(defs, name);
+        if (!vs) {
+            vs = make_vector();
+            map_put(defs, name, vs);
+        }
+        vec_push(vs, v);
+        if (!is_static(v))
+            vec_push(worklist, name);
+    }
+    Map *live = make_map();
+    while (vec_len(worklist) > 0) {
+        char *name = vec_pop(worklist);
+        if (map_get(live, name))
+            continue;
+        map_put(live, name, (void *)1);
+        Vector *vs = map_get(defs, name);
+        if (!vs)
+            continue;
+        for (int i = 0; i < vec_len(vs); i++) {
+            Node *v = vec_get(vs, i);
+            find_refs(&v, worklist);
+        }
+    }
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (map_get(live, toplevel_name(v)))
+            vec_push(r, v);
+    }
+    return r;
+}
+
+/*
+ * Escape analysis
+ *
+ * A local variable escapes if its address is computed anywhere, either
+ * explicitly with "&" or implicitly by array-to-pointer decay. The code
+ * generator may assume that no one else can see a variable that doesn't
+ * escape, and is free to keep it in a register. References are counted
+ * along the way so that it can pick the busiest ones.
+ *
+ * longjmp restores callee-saved registers to the values they had at
+ * setjmp, so every variable of a function calling setjmp is treated as
+ * escaping.
+ */
+
+static bool is_setjmp(char *name) {
+    return !strcmp(name, "setjmp") || !strcmp(name, "_setjmp") ||
+        !strcmp(name, "sigsetjmp") || !strcmp(name, "__sigsetjmp");
+}
+
+static void mark_escaped(Node **p, void *arg) {
+    Node *node = *p;
+    Node *var = NULL;
+    if (node->kind == AST_FUNCALL && is_setjmp(node->fname))
+        *(bool *)arg = true;
+    if (node->kind == AST_ADDR)
+        var = node->operand;
+    else if (node->ty && node->ty->kind == KIND_ARRAY)
+        var = node;
+    if (var) {
+        while (var->kind == AST_STRUCT_REF)
+            var = var->struc;
+        if (var->kind == AST_LVAR)
+            var->addrtaken = true;
+    }
+    visit_children(node, mark_escaped, arg);
+}
+
+static void mark_all_escaped(Vector *vars) {
+    for (int i = 0; i < vec_len(vars); i++)
+        ((Node *)vec_get(vars, i))->addrtaken = true;
+}
+
+static void escape_analysis(Node *func) {
+    bool calls_setjmp = false;
+    visit(&func->body, mark_escaped, &calls_setjmp);
+    if (calls_setjmp) {
+        mark_all_escaped(func->params);
+        mark_all_escaped(func->localvars);
+    }
+}
+
+/*
+ * Loop optimization
+ *
+ * The parser lowers loops to labels and jumps, so a loop is a label and
+ * a later jump back to it in the same statement list. The jump may be
+ * guarded by an if statement, as in do-while. Expressions that don't
+ * change inside a loop are computed once before it. Address computations
+ * "p + i", where p doesn't change and i is only ever incremented by a
+ * constant, are replaced by pointers that are incremented along with i.
+ *
+ * Code placed before a loop would be skipped if something outside jumped
+ * into it, so such loops are left alone, and so are functions that take
+ * label addresses.
+ */
+
+typedef struct {
+    Node *func;
+    Map *jumps;       // number of jumps to each label in the function
+    Vector *modified; // variables assigned in the loop, once per assignment
+    Vector *pre;      // statements to run before the loop
+    Vector *ivs;      // induction variables
+    Vector *ptrs;     // pointers derived from them, as (base, iv, ptr)
+} Loop;
+
+static bool contains(Vector *vec, void *elem) {
+    for (int i = 0; i < vec_len(vec); i++)
+        if (vec_get(vec, i) == elem)
+            return true;
+    return false;
+}
+
+static void find_label_addr(Node **p, void *arg) {
+    if ((*p)->kind == OP_LABEL_ADDR)
+        *(bool *)arg = true;
+    else
+        visit_children(*p, find_label_addr, arg);
+}
+
+static void count_jumps(Node **p, void *arg) {
+    Node *node = *p;
+    if (node->kind == AST_GOTO && node->newlabel) {
+        long n = (long)map_get(arg, node->newlabel);
+        map_put(arg, node->newlabel, (void *)(n + 1));
+    }
+    visit_children(node, count_jumps, arg);
+}
+
+static void find_labels(Node **p, void *arg) {
+    Node *node = *p;
+    if (node->kind == AST_LABEL && node->newlabel)
+        vec_push(arg, node->newlabel);
+    visit_children(node, find_labels, arg);
+}
+
+// Returns true if nothing outside the loop jumps into it.
+static bool is_closed(Loop *loop, Node *body) {
+    Map *inner = make_map();
+    Vector *labels = make_vector();
+    visit(&body, count_jumps, inner);
+    visit(&body, find_labels, labels);
+    for (int i = 0; i < vec_len(labels); i++) {
+        char *label = vec_get(labels, i);
+        if (map_get(loop->jumps, label) != map_get(inner, label))
+            return false;
+    }
+    return true;
+}
+
+static Node *root_var(Node *node) {
+    while (node->kind == AST_STRUCT_REF)
+        node = node->struc;
+    return node;
+}
+
+static void find_modified(Node **p, void *arg) {
+    Node *node = *p;
+    switch (node->kind) {
+    case '=':
+        vec_push(arg, root_var(node->left));
+        break;
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+        vec_push(arg, root_var(node->operand));
+        break;
+    case AST_DECL:
+        vec_push(arg, node->declvar);
+        break;
+    case AST_LVAR:
+        if (node->lvarinit)
+            vec_push(arg, node);
+        break;
+    }
+    visit_children(node, find_modified, arg);
+}
+
+static int count_modified(Loop *loop, Node *var) {
+    int n = 0;
+    for (int i = 0; i < vec_len(loop->modified); i++)
+        if (vec_get(loop->modified, i) == var)
+            n++;
+    return n;
+}
+
+static bool is_scalar(Type *ty) {
+    return is_inttype(ty) || ty->kind == KIND_PTR;
+}
+
+static bool is_pure_binop(Node *node) {
+    switch (node->kind) {
+    case '+': case '-': case '*': case '&': case '|': case '^':
+    case OP_SAL: case OP_SAR: case OP_SHR:
+        return is_scalar(node->ty);
+    }
+    return false;
+}
+
+static bool is_invariant(Loop *loop, Node *node) {
+    switch (node->kind) {
+    case AST_LITERAL:
+        return is_inttype(node->ty);
+    case AST_LVAR:
+        if (node->ty->kind == KIND_ARRAY)
+            return true;
+        return !node->addrtaken && is_scalar(node->ty) && count_modified(loop, node) == 0;
+    case AST_GVAR:
+        return node->ty->kind == KIND_ARRAY;
+    case AST_CONV:
+        return is_scalar(node->ty) && is_invariant(loop, node->operand);
+    }
+    return is_pure_binop(node) && is_invariant(loop, node->left) && is_invariant(loop, node->right);
+}
+
+static Node *make_temp(Loop *loop, Type *ty) {
+    Node *r = copy_node(&(Node){ AST_LVAR, .ty = ty, .varname = "loop.tmp" });
+    vec_push(loop->func->localvars, r);
+    return r;
+}
+
+static Node *make_binop(int kind, Type *ty, Node *left, Node *right) {
+    return copy_node(&(Node){ kind, .ty = ty, .left = left, .right = right });
+}
+
+static Node *make_int(long val) {
+    return copy_node(&(Node){ AST_LITERAL, .ty = type_long, .ival = val });
+}
+
+static void hoist(Node **p, void *arg) {
+    Loop *loop = arg;
+    Node *node = *p;
+    if (is_pure_binop(node) && is_invariant(loop, node)) {
+        Node *var = make_temp(loop, node->ty);
+        vec_push(loop->pre, make_binop('=', var->ty, var, node));
+        *p = var;
+        return;
+    }
+    visit_children(node, hoist, arg);
+}
+
+static bool is_const_int(Node *node, long *val) {
+    if (node->kind == AST_CONV && is_inttype(node->ty))
+        node = node->operand;
+    if (node->kind != AST_LITERAL || !is_inttype(node->ty))
+        return false;
+    *val = node->ival;
+    return true;
+}
+
+// Returns true if the statement adds a constant to var.
+static bool get_step(Node *stmt, Node *var, long *val) {
+    switch (stmt->kind) {
+    case OP_PRE_INC:
+    case OP_POST_INC:
+        *val = 1;
+        return stmt->operand == var;
+    case OP_PRE_DEC:
+    case OP_POST_DEC:
+        *val = -1;
+        return stmt->operand == var;
+    case '=': {
+        Node *r = stmt->right;
+        if (stmt->left != var || (r->kind != '+' && r->kind != '-') || r->left != var)
+            return false;
+        if (!is_const_int(r->right, val))
+            return false;
+        if (r->kind == '-')
+            *val = -*val;
+        return true;
+    }
+    }
+    return false;
+}
+
+// Counts the statements that add a constant to var, looking into
+// compound and if statements but not into expressions.
+static int count_steps(Node *stmt, Node *var) {
+    long val;
+    if (!stmt)
+        return 0;
+    if (get_step(stmt, var, &val))
+        return 1;
+    if (stmt->kind == AST_IF)
+        return count_steps(stmt->then, var) + count_steps(stmt->els, var);
+    if (stmt->kind != AST_COMPOUND_STMT || stmt->ty)
+        return 0;
+    int n = 0;
+    for (int i = 0; i < vec_len(stmt->stmts); i++)
+        n += count_steps(vec_get(stmt->stmts, i), var);
+    return n;
+}
+
+// An induction variable is a signed integer that is only modified by
+// statements adding constants to it.
+static void find_ivs(Loop *loop, Node *body) {
+    for (int i = 0; i < vec_len(loop->modified); i++) {
+        Node *var = vec_get(loop->modified, i);
+        if (var->kind != AST_LVAR || var->addrtaken || contains(loop->ivs, var))
+            continue;
+        int kind = var->ty->kind;
+        if ((kind != KIND_INT && kind != KIND_LONG && kind != KIND_LLONG) || var->ty->usig)
+            continue;
+        if (count_steps(body, var) == count_modified(loop, var))
+            vec_push(loop->ivs, var);
+    }
+}
+
+static bool is_base(Loop *loop, Node *node) {
+    if (node->kind == AST_CONV)
+        node = node->operand;
+    return (node->kind == AST_LVAR || node->kind == AST_GVAR) && is_invariant(loop, node);
+}
+
+static bool same_base(Node *a, Node *b) {
+    if (a->kind == AST_CONV)
+        a = a->operand;
+    if (b->kind == AST_CONV)
+        b = b->operand;
+    if (a->kind == AST_GVAR && b->kind == AST_GVAR)
+        return !strcmp(a->glabel, b->glabel);
+    return a == b;
+}
+
+static void reduce(Node **p, void *arg) {
+    Loop *loop = arg;
+    Node *node = *p;
+    visit_children(node, reduce, arg);
+    if (node->kind != '+' || node->ty->kind != KIND_PTR || !is_base(loop, node->left))
+        return;
+    Node *iv = node->right;
+    if (iv->kind == AST_CONV && is_inttype(iv->ty))
+        iv = iv->operand;
+    if (!contains(loop->ivs, iv))
+        return;
+    for (int i = 0; i < vec_len(loop->ptrs); i += 3) {
+        if (same_base(vec_get(loop->ptrs, i), node->left) && vec_get(loop->ptrs, i + 1) == iv &&
+            ((Node *)vec_get(loop->ptrs, i + 2))->ty->ptr->size == node->ty->ptr->size) {
+            *p = vec_get(loop->ptrs, i + 2);
+            return;
+        }
+    }
+    Node *ptr = make_temp(loop, node->ty);
+    vec_push(loop->pre, make_binop('=', ptr->ty, ptr, node));
+    vec_push(loop->ptrs, node->left);
+    vec_push(loop->ptrs, iv);
+    vec_push(loop->ptrs, ptr);
+    vec_push(loop->modified, ptr);
+    *p = ptr;
+}
+
+// Appends the pointer updates to a statement that steps an induction
+// variable.
+static Node *update_ptrs(Loop *loop, Node *stmt) {
+    for (int i = 0; i < vec_len(loop->ivs); i++) {
+        Node *iv = vec_get(loop->ivs, i);
+        long val;
+        if (!get_step(stmt, iv, &val))
+            continue;
+        Vector *stmts = make_vector();
+        vec_push(stmts, stmt);
+        for (int j = 0; j < vec_len(loop->ptrs); j += 3) {
+            if (vec_get(loop->ptrs, j + 1) != iv)
+                continue;
+            Node *ptr = vec_get(loop->ptrs, j + 2);
+            Node *add = make_binop('+', ptr->ty, ptr, make_int(val));
+            vec_push(stmts, make_binop('=', ptr->ty, ptr, add));
+        }
+        return make_compound(NULL, stmts);
+    }
+    return stmt;
+}
+
+static void insert_updates(Loop *loop, Node **p) {
+    Node *node = *p;
+    if (!node)
+        return;
+    if (node->kind == AST_IF) {
+        insert_updates(loop, &node->then);
+        insert_updates(loop, &node->els);
+        return;
+    }
+    if (node->kind == AST_COMPOUND_STMT && !node->ty) {
+        Node **body = vec_body(node->stmts);
+        for (int i = 0; i < vec_len(node->stmts); i++)
+            insert_updates(loop, &body[i]);
+        return;
+    }
+    *p = update_ptrs(loop, node);
+}
+
+static bool is_back_edge(Node *stmt, char *label) {
+    if (stmt->kind == AST_IF && !stmt->els && stmt->then)
+        stmt = stmt->then;
+    return stmt->kind == AST_GOTO && stmt->newlabel && !strcmp(stmt->newlabel, label);
+}
+
+static void optimize_loop(Loop *loop, Node *body) {
+    loop->modified = make_vector();
+    loop->pre = make_vector();
+    loop->ivs = make_vector();
+    loop->ptrs = make_vector();
+    visit(&body, find_modified, loop->modified);
+    find_ivs(loop, body);
+    if (vec_len(loop->ivs) > 0) {
+        visit(&body, reduce, loop);
+        if (vec_len(loop->ptrs) > 0)
+            insert_updates(loop, &body);
+    }
+    visit(&body, hoist, loop);
+}
+
+// Finds loops in a statement list and optimizes them.
+static void optimize_loops(Node **p, void *arg) {
+    Loop *loop = arg;
+    Node *node = *p;
+    visit_children(node, optimize_loops, arg);
+    if (node->kind != AST_COMPOUND_STMT || node->ty)
+        return;
+    Vector *stmts = node->stmts;
+    for (int i = 0; i < vec_len(stmts); i++) {
+        Node *label = vec_get(stmts, i);
+        if (label->kind != AST_LABEL || !label->newlabel)
+            continue;
+        int end = -1;
+        for (int j = i + 1; j < vec_len(stmts); j++)
+            if (is_back_edge(vec_get(stmts, j), label->newlabel))
+                end = j;
+        // Leave the loop in the shape the code generator vectorizes.
+        if (end < 0 || is_vector_loop(stmts, i))
+            continue;
+        Vector *v = make_vector();
+        for (int j = i; j <= end; j++)
+            vec_push(v, vec_get(stmts, j));
+        Node *body = make_compound(NULL, v);
+        if (!is_closed(loop, body))
+            continue;
+        optimize_loop(loop, body);
+        Vector *r = make_vector();
+        for (int j = 0; j < i; j++)
+            vec_push(r, vec_get(stmts, j));
+        vec_append(r, loop->pre);
+        vec_append(r, v);
+        for (int j = end + 1; j < vec_len(stmts); j++)
+            vec_push(r, vec_get(stmts, j));
+        node->stmts = stmts = r;
+        i += vec_len(loop->pre);
+    }
+}
+
+static void optimize_function_loops(Node *func) {
+    bool labeladdr = false;
+    visit(&func->body, find_label_addr, &labeladdr);
+    if (labeladdr)
+        return;
+    Loop loop = { func, make_map() };
+    visit(&func->body, count_jumps, loop.jumps);
+    visit(&func->body, optimize_loops, &loop);
+}
+
+// The code generator keeps the most referenced variables in registers.
+static void count_uses(Node **p, void *arg) {
+    if ((*p)->kind == AST_LVAR)
+        (*p)->nuses++;
+    visit_children(*p, count_uses, arg);
+}
+
+/*
+ * Profile-guided optimization
+ *
+ * With -fprofile-generate, each function entry and each arm of an if
+ * statement or conditional expression gets a 64-bit counter, and the
+ * program appends the counters to the profile file when it exits. With
+ * -fprofile-use, the counters of all runs are summed up and drive block
+ * layout and section placement in the code generator and the inliner's
+ * thresholds.
+ *
+ * Counters are numbered before any other pass runs, so both builds see
+ * the same numbering as long as the source does not change. A checksum
+ * of the numbering guards against stale profiles.
+ */
+
+bool profile_generate;
+bool profile_use;
+char *profile_file;
+
+static Map *prof_funcs;                // function name -> counter index
+static int nprof = 1;                  // counter 0 is unused
+static unsigned prof_sum = 2166136261u;
+static long *prof_counts;              // NULL if there's no profile
+static long prof_max;                  // max function entry count
+
+static void checksum(char *s) {
+    for (; *s; s++)
+        prof_sum = (prof_sum ^ (unsigned char)*s) * 16777619u;
+}
+
+static void number_branches(Node **p, void *arg) {
+    Node *node = *p;
+    if ((node->kind == AST_IF || node->kind == AST_TERNARY) && !node->profid) {
+        node->profid = nprof;
+        nprof += 2;
+    }
+    visit_children(node, number_branches, arg);
+}
+
+static void number_counters(Vector *toplevels) {
+    prof_funcs = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        map_put(prof_funcs, v->fname, (void *)(intptr_t)nprof++);
+        visit(&v->body, number_branches, NULL);
+        checksum(format("%s:%d", v->fname, nprof));
+    }
+}
+
+static void read_profile(Vector *toplevels) {
+    FILE *fp = fopen(profile_file, "r");
+    if (!fp) {
+        warn("%s: no profile data", profile_file);
+        return;
+    }
+    long *counts = calloc(nprof, sizeof(long));
+    bool found = false, stale = false;
+    int n;
+    unsigned sum;
+    while (fscanf(fp, "8cc-profile %d %u\n", &n, &sum) == 2) {
+        bool match = (n == nprof && sum == prof_sum);
+        for (int i = 0; i < n; i++) {
+            long v;
+            if (fscanf(fp, "%ld\n", &v) != 1)
+                error("%s: malformed profile", profile_file);
+            if (match)
+                counts[i] += v;
+        }
+        found |= match;
+        stale |= !match;
+    }
+    if (!feof(fp))
+        error("%s: malformed profile", profile_file);
+    fclose(fp);
+    if (stale)
+        warn("%s: ignored profile data that does not match the source", profile_file);
+    if (!found)
+        return;
+    prof_counts = counts;
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        long n = profile_count(profile_func_counter(v));
+        if (n > prof_max)
+            prof_max = n;
+    }
+}
+
+int profile_size() {
+    return nprof;
+}
+
+unsigned profile_checksum() {
+    return prof_sum;
+}
+
+int profile_func_counter(Node *func) {
+    if (!prof_funcs)
+        return 0;
+    return (intptr_t)map_get(prof_funcs, func->fname);
+}
+
+// Returns the value of the counter, or -1 if there's no profile.
+long profile_count(int id) {
+    if (!prof_counts || id <= 0)
+        return -1;
+    return prof_counts[id];
+}
+
+// Returns 1 if the function is hot, -1 if it never ran, and 0 otherwise
+// or if there's no profile.
+int func_hotness(Node *func) {
+    long n = profile_count(profile_func_counter(func));
+    if (n < 0)
+        return 0;
+    if (n == 0)
+        return -1;
+    return (n * 100 >= prof_max) ? 1 : 0;
+}
+
+Vector *optimize(Vector *toplevels) {
+    if (profile_generate || profile_use)
+        number_counters(toplevels);
+    if (profile_use)
+        read_profile(toplevels);
+    if (optlevel == 0)
+        return toplevels;
+    // Inlined copies of a function would not count its calls.
+    if (!profile_generate && !instrument_functions && !instrument_cycles)
+        inline_functions(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            visit(&v->body, eliminate, NULL);
+    }
+    toplevels = remove_unused(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        escape_analysis(v);
+        optimize_function_loops(v);
+        visit(&v->body, count_uses, NULL);
+    }
+    return toplevels;
+}
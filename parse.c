@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -22,7 +23,7 @@
 
 // The last source location we want to point to when we find an error in the
 // source code.
-SourceLoc *source_loc;
+static unsigned source_loc;
 
 // Objects representing various scopes. Did you know C has so many different
 // scopes? You can use the same name for global variable, local variable,
@@ -74,7 +75,7 @@ static void read_decl(Vector *toplevel, bool isglobal);
 static Type *read_declarator_tail(Type *basetype, Vector *params);
 static Type *read_declarator(char **name, Type *basetype, Vector *params, int ctx);
 static Type *read_abstract_declarator(Type *basetype);
-static Type *read_decl_spec(int *sclass);
+static Type *read_decl_spec(int *sclass, bool *isinline);
 static Node *read_struct_field(Node *struc);
 static void read_initializer_list(Vector *inits, Type *ty, int off, bool designated);
 static Type *read_cast_type(void);
@@ -111,13 +112,45 @@ enum {
 
 /*
  * Source location
+ *
+ * A location is packed into 32 bits: the upper bits are an index into
+ * loc_files plus one, and the lower LOC_LINE_BITS bits are the line
+ * number. Locations that do not fit are dropped.
  */
 
+#define LOC_LINE_BITS 20
+
+static Vector *loc_files = &EMPTY_VECTOR;
+static Map *loc_file_index = &EMPTY_MAP;
+static char *last_loc_file;
+static unsigned last_loc_index;
+
+static unsigned make_loc(char *file, int line) {
+    if (file != last_loc_file) {
+        last_loc_index = (unsigned)(long)map_get(loc_file_index, file);
+        if (!last_loc_index) {
+            vec_push(loc_files, file);
+            last_loc_index = vec_len(loc_files);
+            map_put(loc_file_index, file, (void *)(long)last_loc_index);
+        }
+        last_loc_file = file;
+    }
+    if (line < 0 || line >= (1 << LOC_LINE_BITS) || last_loc_index >= (1 << (32 - LOC_LINE_BITS)))
+        return 0;
+    return (last_loc_index << LOC_LINE_BITS) | line;
+}
+
+char *loc_file(unsigned loc) {
+    return vec_get(loc_files, (loc >> LOC_LINE_BITS) - 1);
+}
+
+int loc_line(unsigned loc) {
+    return loc & ((1 << LOC_LINE_BITS) - 1);
+}
+
 static void mark_location() {
     Token *tok = peek();
-    source_loc = malloc(sizeof(SourceLoc));
-    source_loc->file = tok->file->name;
-    source_loc->line = tok->line;
+    source_loc = make_loc(tok->file->name, tok->line);
 }
 
 
@@ -152,34 +185,90 @@ static Map *env() {
     return localenv ? localenv : globalenv;
 }
 
-static Node *make_ast(Node *tmpl) {
-    Node *r = malloc(sizeof(Node));
-    *r = *tmpl;
-    r->sourceLoc = source_loc;
+/*
+ * Nodes are carved out of large chunks, and each node only takes as
+ * many bytes as the union member used by its kind. An integer literal
+ * takes 32 bytes while a function call takes the full sizeof(Node).
+ */
+
+#define NODE_CHUNK 65536
+#define NODE_SIZE(field) (offsetof(Node, field) + sizeof(((Node *)0)->field))
+
+static char *node_chunk;
+static int node_chunk_left;
+
+static int node_size(int kind) {
+    switch (kind) {
+    case AST_LITERAL:
+        return NODE_SIZE(slabel);
+    case AST_LVAR: case AST_GVAR:
+        return NODE_SIZE(glabel);
+    case AST_TYPEDEF:
+        return offsetof(Node, ival);
+    case AST_DECL:
+        return NODE_SIZE(declinit);
+    case AST_INIT:
+        return NODE_SIZE(totype);
+    case AST_IF: case AST_TERNARY:
+        return NODE_SIZE(profid);
+    case AST_GOTO: case AST_LABEL: case OP_LABEL_ADDR:
+        return NODE_SIZE(newlabel);
+    case AST_RETURN:
+        return NODE_SIZE(retval);
+    case AST_COMPOUND_STMT:
+        return NODE_SIZE(stmts);
+    case AST_STRUCT_REF:
+        return NODE_SIZE(fieldtype);
+    case AST_FUNCALL: case AST_FUNCPTR_CALL: case AST_FUNCDESG: case AST_FUNC:
+        return sizeof(Node);
+    }
+    // Unary and binary operators
+    if (kind < AST_LITERAL || kind > AST_LABEL ||
+        kind == AST_CONV || kind == AST_ADDR || kind == AST_DEREF || kind == AST_COMPUTED_GOTO)
+        return NODE_SIZE(right);
+    return sizeof(Node);
+}
+
+// Returns a copy of the given node, which may be a template.
+Node *copy_node(Node *node) {
+    int size = (node_size(node->kind) + 7) & ~7;
+    if (node_chunk_left < size) {
+        node_chunk = malloc(NODE_CHUNK);
+        node_chunk_left = NODE_CHUNK;
+    }
+    Node *r = (Node *)node_chunk;
+    node_chunk += size;
+    node_chunk_left -= size;
+    memcpy(r, node, size);
     return r;
 }
 
+static Node *make_ast(Node *tmpl) {
+    tmpl->loc = source_loc;
+    return copy_node(tmpl);
+}
+
 static Node *ast_uop(int kind, Type *ty, Node *operand) {
-    return make_ast(&(Node){ kind, ty, .operand = operand });
+    return make_ast(&(Node){ kind, .ty = ty, .operand = operand });
 }
 
 static Node *ast_binop(Type *ty, int kind, Node *left, Node *right) {
-    Node *r = make_ast(&(Node){ kind, ty });
+    Node *r = make_ast(&(Node){ kind, .ty = ty });
     r->left = left;
     r->right = right;
     return r;
 }
 
 static Node *ast_inttype(Type *ty, long val) {
-    return make_ast(&(Node){ AST_LITERAL, ty, .ival = val });
+    return make_ast(&(Node){ AST_LITERAL, .ty = ty, .ival = val });
 }
 
 static Node *ast_floattype(Type *ty, double val) {
-    return make_ast(&(Node){ AST_LITERAL, ty, .fval = val });
+    return make_ast(&(Node){ AST_LITERAL, .ty = ty, .fval = val });
 }
 
 static Node *ast_lvar(Type *ty, char *name) {
-    Node *r = make_ast(&(Node){ AST_LVAR, ty, .varname = name });
+    Node *r = make_ast(&(Node){ AST_LVAR, .ty = ty, .varname = name });
     if (localenv)
         map_put(localenv, name, r);
     if (localvars)
@@ -188,7 +277,7 @@ static Node *ast_lvar(Type *ty, char *name) {
 }
 
 static Node *ast_gvar(Type *ty, char *name) {
-    Node *r = make_ast(&(Node){ AST_GVAR, ty, .varname = name, .glabel = name });
+    Node *r = make_ast(&(Node){ AST_GVAR, .ty = ty, .varname = name, .glabel = name });
     map_put(globalenv, name, r);
     return r;
 }
@@ -205,7 +294,7 @@ static Node *ast_static_lvar(Type *ty, char *name) {
 }
 
 static Node *ast_typedef(Type *ty, char *name) {
-    Node *r = make_ast(&(Node){ AST_TYPEDEF, ty });
+    Node *r = make_ast(&(Node){ AST_TYPEDEF, .ty = ty });
     map_put(env(), name, r);
     return r;
 }
@@ -247,7 +336,7 @@ static Node *ast_funcall(Type *ftype, char *fname, Vector *args) {
 }
 
 static Node *ast_funcdesg(Type *ty, char *fname) {
-    return make_ast(&(Node){ AST_FUNCDESG, ty, .fname = fname });
+    return make_ast(&(Node){ AST_FUNCDESG, .ty = ty, .fname = fname });
 }
 
 static Node *ast_funcptr_call(Node *fptr, Vector *args) {
@@ -279,7 +368,7 @@ static Node *ast_init(Node *val, Type *totype, int off) {
 }
 
 static Node *ast_conv(Type *totype, Node *val) {
-    return make_ast(&(Node){ AST_CONV, totype, .operand = val });
+    return make_ast(&(Node){ AST_CONV, .ty = totype, .operand = val });
 }
 
 static Node *ast_if(Node *cond, Node *then, Node *els) {
@@ -287,7 +376,7 @@ static Node *ast_if(Node *cond, Node *then, Node *els) {
 }
 
 static Node *ast_ternary(Type *ty, Node *cond, Node *then, Node *els) {
-    return make_ast(&(Node){ AST_TERNARY, ty, .cond = cond, .then = then, .els = els });
+    return make_ast(&(Node){ AST_TERNARY, .ty = ty, .cond = cond, .then = then, .els = els });
 }
 
 static Node *ast_return(Node *retval) {
@@ -299,7 +388,7 @@ static Node *ast_compound_stmt(Vector *stmts) {
 }
 
 static Node *ast_struct_ref(Type *ty, Node *struc, char *name) {
-    return make_ast(&(Node){ AST_STRUCT_REF, ty, .struc = struc, .field = name });
+    return make_ast(&(Node){ AST_STRUCT_REF, .ty = ty, .struc = struc, .field = name });
 }
 
 static Node *ast_goto(char *label) {
@@ -323,7 +412,7 @@ static Node *ast_dest(char *label) {
 }
 
 static Node *ast_label_addr(char *label) {
-    return make_ast(&(Node){ OP_LABEL_ADDR, make_ptr_type(type_void), .label = label });
+    return make_ast(&(Node){ OP_LABEL_ADDR, .ty = make_ptr_type(type_void), .label = label });
 }
 
 static Type *make_type(Type *tmpl) {
@@ -338,40 +427,115 @@ static Type *copy_type(Type *ty) {
     return r;
 }
 
+// Returns the shared type object for a basic type.
 static Type *make_numtype(int kind, bool usig) {
-    Type *r = calloc(1, sizeof(Type));
-    r->kind = kind;
-    r->usig = usig;
-    if (kind == KIND_VOID)         r->size = r->align = 0;
-    else if (kind == KIND_BOOL)    r->size = r->align = 1;
-    else if (kind == KIND_CHAR)    r->size = r->align = 1;
-    else if (kind == KIND_SHORT)   r->size = r->align = 2;
-    else if (kind == KIND_INT)     r->size = r->align = 4;
-    else if (kind == KIND_LONG)    r->size = r->align = 8;
-    else if (kind == KIND_LLONG)   r->size = r->align = 8;
-    else if (kind == KIND_FLOAT)   r->size = r->align = 4;
-    else if (kind == KIND_DOUBLE)  r->size = r->align = 8;
-    else if (kind == KIND_LDOUBLE) r->size = r->align = 8;
-    else error("internal error");
-    return r;
+    switch (kind) {
+    case KIND_BOOL:    return type_bool;
+    case KIND_CHAR:    return usig ? type_uchar : type_char;
+    case KIND_SHORT:   return usig ? type_ushort : type_short;
+    case KIND_INT:     return usig ? type_uint : type_int;
+    case KIND_LONG:    return usig ? type_ulong : type_long;
+    case KIND_LLONG:   return usig ? type_ullong : type_llong;
+    case KIND_FLOAT:   return type_float;
+    case KIND_DOUBLE:  return type_double;
+    case KIND_LDOUBLE: return type_ldouble;
+    default: error("internal error");
+    }
+}
+
+/*
+ * Type interning
+ *
+ * Pointer, array and function types are hash-consed: building the same
+ * type from the same components twice returns the same object. That
+ * saves memory ("char *" is built for every string literal) and lets
+ * type comparisons succeed by address in the common case.
+ *
+ * Interned types are shared and must not be modified. Code that needs
+ * to set a per-declaration attribute such as isstatic works on a copy.
+ */
+
+static Type **type_table;
+static int type_table_size;
+static int type_table_nelem;
+
+static uint32_t hash_ptr(uint32_t h, void *p) {
+    return (h ^ (uint32_t)((long)p >> 4)) * 16777619;
+}
+
+static uint32_t type_hash(Type *ty) {
+    uint32_t h = 2166136261;
+    h = (h ^ ty->kind) * 16777619;
+    h = (h ^ ty->len) * 16777619;
+    h = hash_ptr(h, ty->ptr);
+    h = hash_ptr(h, ty->rettype);
+    if (ty->params)
+        for (int i = 0; i < vec_len(ty->params); i++)
+            h = hash_ptr(h, vec_get(ty->params, i));
+    return h;
+}
+
+static bool same_params(Vector *a, Vector *b) {
+    if (!a || !b)
+        return a == b;
+    if (vec_len(a) != vec_len(b))
+        return false;
+    for (int i = 0; i < vec_len(a); i++)
+        if (vec_get(a, i) != vec_get(b, i))
+            return false;
+    return true;
+}
+
+static bool same_type_key(Type *a, Type *b) {
+    return a->kind == b->kind && a->len == b->len && a->ptr == b->ptr &&
+        a->rettype == b->rettype && a->hasva == b->hasva &&
+        a->oldstyle == b->oldstyle && same_params(a->params, b->params);
+}
+
+static void rehash_type_table() {
+    int oldsize = type_table_size;
+    Type **old = type_table;
+    type_table_size = oldsize ? oldsize * 2 : 256;
+    type_table = calloc(type_table_size, sizeof(Type *));
+    int mask = type_table_size - 1;
+    for (int i = 0; i < oldsize; i++) {
+        if (!old[i])
+            continue;
+        int j = type_hash(old[i]) & mask;
+        while (type_table[j])
+            j = (j + 1) & mask;
+        type_table[j] = old[i];
+    }
+}
+
+static Type *intern_type(Type *tmpl) {
+    if (type_table_nelem >= type_table_size * 0.7)
+        rehash_type_table();
+    int mask = type_table_size - 1;
+    int i = type_hash(tmpl) & mask;
+    for (; type_table[i]; i = (i + 1) & mask)
+        if (same_type_key(type_table[i], tmpl))
+            return type_table[i];
+    type_table_nelem++;
+    return type_table[i] = make_type(tmpl);
 }
 
 static Type* make_ptr_type(Type *ty) {
-    return make_type(&(Type){ KIND_PTR, .ptr = ty, .size = 8, .align = 8 });
+    return intern_type(&(Type){ KIND_PTR, .ptr = ty, .size = 8, .align = 8 });
 }
 
 static Type* make_array_type(Type *ty, int len) {
-    int size;
-    if (len < 0)
-        size = -1;
-    else
-        size = ty->size * len;
-    return make_type(&(Type){
+    Type tmpl = {
         KIND_ARRAY,
         .ptr = ty,
-        .size = size,
+        .size = (len < 0) ? -1 : ty->size * len,
         .len = len,
-        .align = ty->align });
+        .align = ty->align };
+    // Incomplete arrays get their length from an initializer, and the
+    // size of an incomplete element type is not known yet.
+    if (len < 0 || ty->size <= 0)
+        return make_type(&tmpl);
+    return intern_type(&tmpl);
 }
 
 static Type* make_rectype(bool is_struct) {
@@ -379,7 +543,7 @@ static Type* make_rectype(bool is_struct) {
 }
 
 static Type* make_func_type(Type *rettype, Vector *paramtypes, bool has_varargs, bool oldstyle) {
-    return make_type(&(Type){
+    return intern_type(&(Type){
         KIND_FUNC,
         .rettype = rettype,
         .params = paramtypes,
@@ -583,6 +747,8 @@ static Node *binop(int op, Node *lhs, Node *rhs) {
 }
 
 static bool is_same_struct(Type *a, Type *b) {
+    if (a == b)
+        return true;
     if (a->kind != b->kind)
         return false;
     switch (a->kind) {
@@ -832,6 +998,8 @@ static Node *read_funcall(Node *fp) {
  */
 
 static bool type_compatible(Type *a, Type *b) {
+    if (a == b)
+        return true;
     if (a->kind == KIND_STRUCT)
         return is_same_struct(a, b);
     if (a->kind != b->kind)
@@ -1134,7 +1302,7 @@ static Node *read_compound_literal(Type *ty) {
 }
 
 static Type *read_cast_type() {
-    return read_abstract_declarator(read_decl_spec(NULL));
+    return read_abstract_declarator(read_decl_spec(NULL, NULL));
 }
 
 static Node *read_cast_expr() {
@@ -1375,7 +1543,7 @@ static Vector *read_rectype_fields_sub() {
         }
         if (!is_type(peek()))
             break;
-        Type *basetype = read_decl_spec(NULL);
+        Type *basetype = read_decl_spec(NULL, NULL);
         if (basetype->kind == KIND_STRUCT && next_token(';')) {
             vec_push(r, make_pair(NULL, basetype));
             continue;
@@ -1522,6 +1690,7 @@ static Type *read_rectype_def(bool is_struct) {
             error("declarations of %s does not match", tag);
         if (!r) {
             r = make_rectype(is_struct);
+            r->tag = tag;
             map_put(tags, tag, r);
         }
     } else {
@@ -1821,7 +1990,7 @@ static Type *read_func_param(char **name, bool optional) {
     int sclass = 0;
     Type *basety = type_int;
     if (is_type(peek())) {
-        basety = read_decl_spec(&sclass);
+        basety = read_decl_spec(&sclass, NULL);
     } else if (optional) {
         errort(peek(), "type expected, but got %s", tok2s(peek()));
     }
@@ -2025,8 +2194,9 @@ static int read_alignas() {
     return r;
 }
 
-static Type *read_decl_spec(int *rsclass) {
+static Type *read_decl_spec(int *rsclass, bool *risinline) {
     int sclass = 0;
+    bool isinline = false;
     Token *tok = peek();
     if (!is_type(tok))
         errort(tok, "type name expected, but got %s", tok2s(tok));
@@ -2061,7 +2231,7 @@ static Type *read_decl_spec(int *rsclass) {
         case KREGISTER: if (sclass) goto err; sclass = S_REGISTER; break;
         case KCONST:    break;
         case KVOLATILE: break;
-        case KINLINE:   break;
+        case KINLINE:   isinline = true; break;
         case KNORETURN: break;
         case KVOID:     if (kind) goto err; kind = kvoid; break;
         case KBOOL:     if (kind) goto err; kind = kbool; break;
@@ -2116,6 +2286,8 @@ static Type *read_decl_spec(int *rsclass) {
  done:
     if (rsclass)
         *rsclass = sclass;
+    if (risinline)
+        *risinline = isinline;
     if (usertype)
         return usertype;
     if (align != -1 && !is_poweroftwo(align))
@@ -2137,8 +2309,10 @@ static Type *read_decl_spec(int *rsclass) {
     }
     error("internal error: kind: %d, size: %d", kind, size);
  end:
-    if (align != -1)
+    if (align != -1) {
+        ty = copy_type(ty);
         ty->align = align;
+    }
     return ty;
  err:
     errort(tok, "type mismatch: %s", tok2s(tok));
@@ -2160,22 +2334,25 @@ static void read_static_local_var(Type *ty, char *name) {
     vec_push(toplevels, ast_decl(var, init));
 }
 
-static Type *read_decl_spec_opt(int *sclass) {
+static Type *read_decl_spec_opt(int *sclass, bool *isinline) {
     if (is_type(peek()))
-        return read_decl_spec(sclass);
+        return read_decl_spec(sclass, isinline);
     warnt(peek(), "type specifier missing, assuming int");
     return type_int;
 }
 
 static void read_decl(Vector *block, bool isglobal) {
     int sclass = 0;
-    Type *basetype = read_decl_spec_opt(&sclass);
+    Type *basetype = read_decl_spec_opt(&sclass, NULL);
     if (next_token(';'))
         return;
     for (;;) {
         char *name = NULL;
         Type *ty = read_declarator(&name, copy_incomplete_type(basetype), NULL, DECL_BODY);
-        ty->isstatic = (sclass == S_STATIC);
+        if (ty->isstatic != (sclass == S_STATIC)) {
+            ty = copy_type(ty);
+            ty->isstatic = (sclass == S_STATIC);
+        }
         if (sclass == S_TYPEDEF) {
             ast_typedef(ty, name);
         } else if (ty->isstatic && !isglobal) {
@@ -2332,13 +2509,14 @@ static void backfill_labels() {
 
 static Node *read_funcdef() {
     int sclass = 0;
-    Type *basetype = read_decl_spec_opt(&sclass);
+    bool isinline = false;
+    Type *basetype = read_decl_spec_opt(&sclass, &isinline);
     localenv = make_map_parent(globalenv);
     gotos = make_vector();
     labels = make_map();
     char *name;
     Vector *params = make_vector();
-    Type *functype = read_declarator(&name, basetype, params, DECL_BODY);
+    Type *functype = copy_type(read_declarator(&name, basetype, params, DECL_BODY));
     if (functype->oldstyle) {
         if (vec_len(params) == 0)
             functype->hasva = false;
@@ -2346,6 +2524,7 @@ static Node *read_funcdef() {
         functype->params = param_types(params);
     }
     functype->isstatic = (sclass == S_STATIC);
+    functype->isinline = isinline;
     ast_gvar(functype, name);
     expect('{');
     Node *r = read_func_body(functype, name, params);
@@ -2752,8 +2931,15 @@ static Token *peek() {
  * Initializer
  */
 
-static void define_builtin(char *name, Type *rettype, Vector *paramtypes) {
-    ast_gvar(make_func_type(rettype, paramtypes, true, false), name);
+static void define_builtin(char *name, Type *rettype, Vector *paramtypes, bool hasva) {
+    ast_gvar(make_func_type(rettype, paramtypes, hasva, false), name);
+}
+
+// Defines name, namel and namell taking unsigned int, long and long long.
+static void define_builtin_family(char *name, Type *rettype) {
+    define_builtin(name, rettype, make_vector1(type_uint), false);
+    define_builtin(format("%sl", name), rettype, make_vector1(type_ulong), false);
+    define_builtin(format("%sll", name), rettype, make_vector1(type_ullong), false);
 }
 
 void parse_init() {
@@ -2761,8 +2947,30 @@ void parse_init() {
     Vector *two_voidptrs = make_vector();
     vec_push(two_voidptrs, make_ptr_type(type_void));
     vec_push(two_voidptrs, make_ptr_type(type_void));
-    define_builtin("__builtin_return_address", make_ptr_type(type_void), voidptr);
-    define_builtin("__builtin_reg_class", type_int, voidptr);
-    define_builtin("__builtin_va_arg", type_void, two_voidptrs);
-    define_builtin("__builtin_va_start", type_void, voidptr);
+    define_builtin("__builtin_return_address", make_ptr_type(type_void), voidptr, true);
+    define_builtin("__builtin_reg_class", type_int, voidptr, true);
+    define_builtin("__builtin_va_arg", type_void, two_voidptrs, true);
+    define_builtin("__builtin_va_start", type_void, voidptr, true);
+
+    Vector *memcpy_params = make_vector();
+    vec_push(memcpy_params, make_ptr_type(type_void));
+    vec_push(memcpy_params, make_ptr_type(type_void));
+    vec_push(memcpy_params, type_ulong);
+    define_builtin("__builtin_memcpy", make_ptr_type(type_void), memcpy_params, false);
+    Vector *memset_params = make_vector();
+    vec_push(memset_params, make_ptr_type(type_void));
+    vec_push(memset_params, type_int);
+    vec_push(memset_params, type_ulong);
+    define_builtin("__builtin_memset", make_ptr_type(type_void), memset_params, false);
+    define_builtin_family("__builtin_popcount", type_int);
+    define_builtin_family("__builtin_clz", type_int);
+    define_builtin_family("__builtin_ctz", type_int);
+    define_builtin("__builtin_bswap16", type_ushort, make_vector1(type_ushort), false);
+    define_builtin("__builtin_bswap32", type_uint, make_vector1(type_uint), false);
+    define_builtin("__builtin_bswap64", type_ulong, make_vector1(type_ulong), false);
+    Vector *two_longs = make_vector();
+    vec_push(two_longs, type_long);
+    vec_push(two_longs, type_long);
+    define_builtin("__builtin_expect", type_long, two_longs, false);
+    define_builtin("__builtin_prefetch", type_void, voidptr, true);
 }
@@ -72,6 +72,9 @@ static void test_ternary() {
     // GNU extension
     expect(52, 0 ?: 52);
     expect(3, (1 + 2) ?: 52);
+    int x = 1;
+    expect(1, (x < 2) ?: 52);
+    expect(52, (x > 2) ?: 52);
 }
 
 static void test_unary() {
@@ -33,7 +33,7 @@ function testm {
 }
 
 function testcpp {
-    echo "$2" | ./8cc -o - -E $3 - > tmp.s || fail "Failed to compile $1"
+    echo "$2" | ./8cc -o - -E -P $3 - > tmp.s || fail "Failed to compile $1"
     assertequal "$(cat tmp.s)" "$1"
 }
 
@@ -0,0 +1,125 @@
+#!/bin/bash
+# Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+# Preprocessor microbenchmarks. Each case is preprocessed a number of
+# times with -E and the total wall-clock time is printed. Then the same
+# is done in a single process through libcpp.a, printing the time and
+# the number of tokens read per second.
+
+ECC=${ECC:-./8cc}
+N=${N:-20}
+
+function bench {
+    TIMEFORMAT="$(printf '%-12s' $1) %R s"
+    time (for i in $(seq $N); do $ECC -E $2 > /dev/null || exit 1; done)
+}
+
+# Header-heavy translation unit.
+cat > tmp-headers.c <<END
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+END
+
+# Lots of #if lines, as found in configuration headers.
+for i in $(seq 2000); do
+    echo "#if defined(FOO_$i) || (__STDC_VERSION__ >= 199901L && $i * 3 % 7 == 2) || 0x$i > 0xffff"
+    echo "int v$i;"
+    echo "#elif !defined(__8cc__) && ($i << 2) > 100"
+    echo "int w$i;"
+    echo "#endif"
+done > tmp-if.c
+
+# Large excluded groups with nested conditionals and comments.
+(echo "#if 0"
+ for i in $(seq 5000); do
+     echo "#ifdef BAR_$i"
+     echo "static int f$i(int x) { /* x */ return x * $i; } // 'don't"
+     echo "#else"
+     echo "static const char *s$i = \"#endif $i\";"
+     echo "#endif"
+ done
+ echo "#endif") > tmp-skip.c
+
+# A generated table referencing constants heavily.
+(echo "#include <stdint.h>"
+ echo "#include <errno.h>"
+ for i in $(seq 50); do
+     echo "#define BASE_$i ((uint32_t)$i << 8)"
+     echo "#define CODE_$i (BASE_$i | (UINT32_MAX & EINVAL))"
+ done
+ echo "uint32_t table[] = {"
+ for i in $(seq 2000); do
+     echo "    CODE_$((i % 50 + 1)), BASE_$((i % 50 + 1)), INT32_MAX, UINT16_MAX, ENOMEM,"
+ done
+ echo "};") > tmp-const.c
+
+# Logging and assertion macros.
+(echo "#define LOG_LEVEL 2"
+ echo "#define LOG(level, fmt, ...) do { if ((level) >= LOG_LEVEL) log_printf(__FILE__, __LINE__, #level, fmt, ##__VA_ARGS__); } while (0)"
+ echo "#define ASSERT(cond) ((cond) ? (void)0 : assert_fail(#cond, __FILE__, __LINE__))"
+ echo "#define CHECK_EQ(a, b) ASSERT((a) == (b))"
+ echo "#define MIN(a, b) ((a) < (b) ? (a) : (b))"
+ echo "void f(int x, int y) {"
+ for i in $(seq 2000); do
+     echo "    LOG(1, \"x=%d y=%d\", x + $i, MIN(y, $i));"
+     echo "    CHECK_EQ(MIN(x, y) + $i, MIN(MIN(x, $i), y));"
+ done
+ echo "}") > tmp-log.c
+
+bench headers tmp-headers.c
+bench if tmp-if.c
+bench skip tmp-skip.c
+bench const tmp-const.c
+bench log tmp-log.c
+
+cat > tmp-lib.c <<'END'
+#include <stdlib.h>
+#include "8cc.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int n = atoi(argv[1]);
+    for (int i = 2; i < argc; i += 2) {
+        double start = now();
+        long ntok = 0;
+        for (int j = 0; j < n; j++) {
+            Preprocessor *pp = pp_new();
+            Token *buf[256];
+            int len = pp_open_file(pp, argv[i + 1]);
+            while (len >= 0 && (len = pp_read(pp, buf, 256)) > 0)
+                ntok += len;
+            if (len < 0) {
+                fprintf(stderr, "%s\n", pp_error(pp));
+                return 1;
+            }
+        }
+        double t = now() - start;
+        printf("%-12s %.3f s %10.0f tokens/s\n", argv[i], t, ntok / t);
+    }
+    return 0;
+}
+END
+cc -I. -o tmp-lib tmp-lib.c libcpp.a $LDFLAGS || exit 1
+./tmp-lib $N lib-headers tmp-headers.c lib-if tmp-if.c lib-skip tmp-skip.c \
+    lib-const tmp-const.c lib-log tmp-log.c
+rm -f tmp-headers.c tmp-if.c tmp-skip.c tmp-const.c tmp-log.c tmp-lib.c tmp-lib
@@ -28,7 +28,76 @@ static void test_return_address() {
 static void test_return_address() {}
 #endif
 
+static void test_memcpy() {
+    char src[19] = "abcdefghijklmnopqr";
+    char dst[20];
+    __builtin_memset(dst, 'x', 20);
+    expect((long)dst, (long)__builtin_memcpy(dst, src, 15));
+    expect('a', dst[0]);
+    expect('h', dst[7]);
+    expect('o', dst[14]);
+    expect('x', dst[15]);
+    int n = 19;
+    __builtin_memcpy(dst, src, n);
+    expect(0, dst[18]);
+    expect('x', dst[19]);
+}
+
+static void test_memset() {
+    int a[4] = { 1, 2, 3, 4 };
+    __builtin_memset(a, 0, 12);
+    expect(0, a[2]);
+    expect(4, a[3]);
+    unsigned char b[7] = { 0 };
+    __builtin_memset(b + 1, 0x1ff, 5);
+    expect(0, b[0]);
+    expect(255, b[5]);
+    expect(0, b[6]);
+    int n = 3;
+    __builtin_memset(b, 'z', n);
+    expect('z', b[2]);
+    expect(255, b[3]);
+}
+
+static void test_bits() {
+    expect(0, __builtin_popcount(0));
+    expect(12, __builtin_popcount(0x8421ff00));
+    expect(32, __builtin_popcount(-1));
+    expect(64, __builtin_popcountl(-1));
+    expect(33, __builtin_popcountll(0x80000000ffffffffULL));
+    expect(31, __builtin_clz(1));
+    expect(0, __builtin_clz(0x80000000u));
+    expect(23, __builtin_clzl(1L << 40));
+    expect(0, __builtin_ctz(1));
+    expect(40, __builtin_ctzll(1LL << 40));
+    expect(0x3412, __builtin_bswap16(0x1234));
+    expect(0x78563412, __builtin_bswap32(0x12345678));
+    expectl(0x0807060504030201L, __builtin_bswap64(0x0102030405060708L));
+}
+
+static int expect_branch(int x) {
+    if (__builtin_expect(x > 3, 0))
+        return 1;
+    if (__builtin_expect(!x, 1))
+        return 2;
+    return __builtin_expect(x, 7);
+}
+
+static void test_hints() {
+    expect(1, expect_branch(5));
+    expect(2, expect_branch(0));
+    expect(3, expect_branch(3));
+    int a[2] = { 5, 6 };
+    __builtin_prefetch(a);
+    __builtin_prefetch(a + 1, 0, 0);
+    expect(6, a[1]);
+}
+
 void testmain() {
     print("builtin");
     test_return_address();
+    test_memcpy();
+    test_memset();
+    test_bits();
+    test_hints();
 }
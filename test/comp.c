@@ -2,6 +2,49 @@
 
 #include "test.h"
 
+static int count;
+static int tick(int v) { count++; return v; }
+
+static void test_branch() {
+    int a = 1, b = 2;
+    unsigned u = -1;
+    double x = 1.5, y = 2.5;
+    expect(1, a < b ? 1 : 0);
+    expect(0, a > b ? 1 : 0);
+    expect(1, u > 1 ? 1 : 0);
+    expect(1, x < y ? 1 : 0);
+    expect(0, x >= y ? 1 : 0);
+    expect(1, !(a == b) ? 1 : 0);
+    expect(1, (a < b && x < y) ? 1 : 0);
+    expect(0, (a < b && !(x < y)) ? 1 : 0);
+    expect(1, (a > b || !(x > y)) ? 1 : 0);
+    expect(0, !(a < b || x > y) ? 1 : 0);
+    expect(1, (a < b) && 3);
+    expect(0, 0 || (a > b));
+
+    count = 0;
+    if (tick(0) && tick(1))
+        count += 10;
+    expect(1, count);
+    count = 0;
+    if (tick(1) || tick(1))
+        count += 10;
+    expect(11, count);
+    count = 0;
+    if (!(tick(1) && tick(0)) || tick(1))
+        count += 10;
+    expect(12, count);
+
+    int n = 0;
+    while (n < 10 && n != 5)
+        n++;
+    expect(5, n);
+    do
+        n--;
+    while (n > 0 || 0);
+    expect(0, n);
+}
+
 void testmain() {
     print("comparison operators");
     expect(1, 1 < 2);
@@ -36,4 +79,6 @@ void testmain() {
     expect(0, 10.0f == 20.0);
     expect(0, 10.0f != 10.0);
     expect(1, 10.0f != 20.0);
+
+    test_branch();
 }
@@ -0,0 +1,215 @@
+#!/bin/bash
+# Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+# Tests for preprocessor options.
+
+function fail {
+    echo -n -e '\e[1;31m[ERROR]\e[0m '
+    echo "$1"
+    exit 1
+}
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+mkdir -p $dir/a $dir/b $dir/c
+echo "int b;" > $dir/b/b.h
+echo "int c;" > $dir/c/c.h
+
+# -finclude-stats. b.h is found in the second directory and c.h in the
+# third one; the second #include of each is answered from the cache.
+# (The compiler's own startup header adds one more lookup.)
+cat > $dir/stats.c <<END
+#include <b.h>
+#include <c.h>
+#include <b.h>
+#include <c.h>
+END
+./8cc -E -finclude-stats -I$dir/a -I$dir/b -I$dir/c $dir/stats.c 2> $dir/stats.txt > /dev/null ||
+    fail "-finclude-stats"
+grep -q '^include lookups: 11$' $dir/stats.txt || fail "-finclude-stats: lookups"
+grep -q '^  cache hits: *5 (3 not found)$' $dir/stats.txt || fail "-finclude-stats: hits"
+grep -q '^  cache misses: *6 (3 not found)$' $dir/stats.txt || fail "-finclude-stats: misses"
+
+# A file is not opened again if including it would be a no-op, even if
+# it is reached through a symbolic link. (One file opened is the
+# compiler's startup header.)
+mkdir -p $dir/g
+printf '// guard\n#if !defined(G_H)\n#define G_H\nint g;\n#endif\n' > $dir/g/g.h
+printf '#pragma once\nint o;\n' > $dir/g/o.h
+ln -s g.h $dir/g/gl.h
+ln -s o.h $dir/g/ol.h
+printf '#include "g.h"\n#include "gl.h"\n#include "o.h"\n#include "ol.h"\n#include "g/g.h"\n' > $dir/g/main.c
+./8cc -E -finclude-stats -I$dir $dir/g/main.c 2> $dir/stats.txt > $dir/g/main.i || fail "guard: $(cat $dir/stats.txt)"
+grep -q '^files opened: *3$' $dir/stats.txt || fail "guard: files opened"
+grep -q '^files skipped: *3$' $dir/stats.txt || fail "guard: files skipped"
+
+# -fmacro-report. The inner F is expanded while expanding the argument
+# of the outer one, into "(1 + 2)", and the outer one into "((1 + 2))".
+# g.h is read once; the second #include is skipped by its guard.
+cat > $dir/g/report.c <<END
+#include "g.h"
+#include "g.h"
+#define A 1 + 2
+#define F(x) (x)
+int x = F(F(A)) + A + A;
+END
+./8cc -E -fmacro-report -I$dir $dir/g/report.c 2> $dir/report.txt > /dev/null || fail "-fmacro-report"
+grep -q '^  F  *2  *12  *[0-9]*$' $dir/report.txt || fail "-fmacro-report: F"
+grep -q '^  A  *3  *9  *[0-9]*$' $dir/report.txt || fail "-fmacro-report: A"
+grep -q "^  .*/g/g.h  *2  *$(wc -c < $dir/g/g.h)$" $dir/report.txt || fail "-fmacro-report: g.h"
+./8cc -E -fmacro-report=1 -I$dir $dir/g/report.c 2> $dir/report.txt > /dev/null || fail "-fmacro-report=1"
+[ "$(grep -c '^  ' $dir/report.txt)" = 4 ] || fail "-fmacro-report=1: $(cat $dir/report.txt)"
+
+# -E output compiles to the same program. Tokens on both sides of a
+# macro, even one expanding to nothing, must not be pasted together.
+cat > $dir/paste.c <<'END'
+#define EMPTY
+#define P +
+#define M -
+int printf(char *fmt, ...);
+int main() {
+    int x = 3;
+    printf("%d %d %d %d %d\n", -EMPTY-x, +EMPTY+x, x + P+x, x - M-x, x);
+    return 0;
+}
+END
+./8cc -E -o $dir/paste.i $dir/paste.c || fail "-E: paste"
+./8cc -c -o $dir/paste.o $dir/paste.i || fail "-E: paste: $(cat $dir/paste.i)"
+cc -o $dir/paste $dir/paste.o $LDFLAGS || fail "-E: paste: link"
+[ "$($dir/paste)" = "3 3 6 0 3" ] || fail "-E: paste: $(grep printf $dir/paste.i)"
+[ "$(echo '__LINE__.5' | ./8cc -E -P -)" = "1 .5" ] || fail "-E: paste: __LINE__"
+
+# libcpp.a. Two preprocessors are read in turn, one token at a time,
+# each with its own macros and __COUNTER__. Errors are returned instead
+# of terminating the process, and don't affect other preprocessors.
+cat > $dir/lib.c <<'END'
+#include <string.h>
+#include "8cc.h"
+
+static char *read_some(Preprocessor *pp, int n) {
+    Token *buf[4];
+    int len = pp_read(pp, buf, n);
+    if (len < 0)
+        return format("error: %s", pp_error(pp));
+    char *r = "";
+    for (int i = 0; i < len; i++)
+        r = format("%s%s ", r, tok2s(buf[i]));
+    return r;
+}
+
+static char *read_all(Preprocessor *pp, int n) {
+    char *r = "";
+    for (;;) {
+        char *s = read_some(pp, n);
+        r = format("%s%s", r, s);
+        if (!*s || !strncmp(s, "error: ", 7))
+            return r;
+    }
+}
+
+int main(int argc, char **argv) {
+    Preprocessor *a = pp_new(), *b = pp_new();
+    pp_define(a, "X=1");
+    pp_define(b, "X=2");
+    pp_open_buffer(a, "a.c", "#define F(x) x + X\nF(__COUNTER__) __COUNTER__ __BASE_FILE__\n");
+    pp_open_buffer(b, "b.c", "#define F(x) x * X\nF(__COUNTER__)\n__BASE_FILE__ __LINE__\n");
+    char *sa = "", *sb = "";
+    for (int i = 0; i < 6; i++) {
+        if (i == 3) {
+            Preprocessor *c = pp_new();
+            pp_open_buffer(c, "c.c", "int x;\n#if 1\n#error boom\n#endif\n");
+            printf("%s\n", read_all(c, 4));
+            Preprocessor *d = pp_new();
+            if (pp_open_file(d, "nonexistent.c") < 0)
+                printf("%s\n", pp_error(d));
+        }
+        sa = format("%s%s", sa, read_some(a, 1));
+        sb = format("%s%s", sb, read_some(b, 1));
+    }
+    printf("%s\n%s\n", sa, sb);
+
+    Preprocessor *e = pp_new();
+    pp_add_include_path(e, argv[1]);
+    if (pp_open_file(e, argv[2]) < 0)
+        printf("%s\n", pp_error(e));
+    printf("%d\n", strstr(read_all(e, 3), "int g ; int n ;") != NULL);
+    Vector *deps = pp_dependencies(e, false);
+    for (int i = 0; i < vec_len(deps); i++)
+        printf("%s\n", (char *)vec_get(deps, i));
+    printf("%d\n", vec_len(pp_dependencies(e, true)) > vec_len(deps));
+    return 0;
+}
+END
+printf '#include <g.h>\n#include "g.h"\nint n;\n#include <stddef.h>\n' > $dir/g/lib.c
+expected="error: c.c:3:1: #error: boom
+Cannot open nonexistent.c: No such file or directory
+0 + 1 1 \"a.c\" 
+0 * 2 \"b.c\" 3 
+1
+$dir/g/g.h
+1"
+cc -I. -o $dir/lib $dir/lib.c libcpp.a $LDFLAGS || fail "libcpp.a: link"
+[ "$($dir/lib $dir/g $dir/g/lib.c)" = "$expected" ] || fail "libcpp.a: $($dir/lib $dir/g $dir/g/lib.c)"
+
+# Dependency output. Headers are listed in the order they are first
+# included, with paths relative to the current directory.
+mkdir -p $dir/d/sub
+echo '#include "sub/x.h"' > $dir/d/main.c
+echo '#include <stddef.h>' >> $dir/d/main.c
+echo '#include "sub/x.h"' >> $dir/d/main.c
+echo '#include "y.h"' > $dir/d/sub/x.h
+echo 'extern int y;' > $dir/d/sub/y.h
+cc=$(pwd)/8cc
+cd $dir/d
+expected="main.o: main.c \\
+  sub/x.h \\
+  sub/y.h"
+[ "$($cc -MM main.c)" = "$expected" ] || fail "-MM"
+$cc -M main.c | grep -q '^  .*/include/stddef.h' || fail "-M"
+$cc -MM -MT 'obj/a.o b.o' main.c | grep -q '^obj/a.o b.o: main.c' || fail "-MT"
+$cc -MM -MP -MF deps main.c && grep -q '^sub/y.h:$' deps || fail "-MP"
+$cc -MMD -c main.c && [ "$(cat main.d)" = "$expected" ] || fail "-MMD"
+$cc -MD -c -o obj.o main.c && grep -q '^obj.o: main.c' obj.d || fail "-MD"
+cd - > /dev/null
+
+# -E keeps the line structure of the input and marks jumps with line
+# markers, which are understood when the output is read back.
+cat > $dir/d/e.h <<END
+#define PLUS(x) +x
+int h;
+END
+cat > $dir/d/e.c <<END
+#include "e.h"
+int a = 1 PLUS(+1);
+#define STR "a\\tb\\"c\\001"
+
+
+
+char *s = STR,
+    *t = __FILE__;
+int b = __LINE__;
+#line 100 "x.c"
+int c = __LINE__;
+END
+expected="# 1 \"e.c\"
+# 2 \"$dir/d/e.h\" 1
+int h;
+# 2 \"e.c\" 2
+int a = 1 + +1;
+
+
+
+
+char *s = \"a\\011b\\\"c\\001\",
+    *t = \"e.c\";
+int b = 9;
+# 100 \"x.c\"
+int c = 100;"
+cd $dir/d
+[ "$($cc -E e.c)" = "$expected" ] || fail "-E: $($cc -E e.c)"
+$cc -E -o e.i e.c && [ "$(cat e.i)" = "$expected" ] || fail "-E -o"
+$cc -E e.i | grep -q '^int c = 100;$' || fail "-E: line markers"
+$cc -E -P e.c | grep -q '^#' && fail "-P"
+cd - > /dev/null
+
+echo "Preprocessor tests passed"
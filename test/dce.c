@@ -0,0 +1,86 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include "test.h"
+
+#define DEBUG 0
+
+static int unused_var = 3;
+static int unused_func(void) { return unused_var; }
+static int used_var = 5;
+static int used_func(void) { return used_var; }
+
+static int after_return(int x) {
+    return x;
+    x = 100;
+    return x;
+}
+
+static int goto_into_dead(void) {
+    int x = 0;
+    goto L;
+    if (0) {
+      L:
+        x = 5;
+    }
+    return x;
+}
+
+static int dead_branches(int x) {
+    if (DEBUG)
+        x = 100;
+    if (!DEBUG)
+        x++;
+    else
+        x = 200;
+    return DEBUG ? 300 : x;
+}
+
+static int loops(void) {
+    int n = 0;
+    while (1) {
+        if (++n == 3)
+            break;
+    }
+    do {
+        n++;
+    } while (0);
+    for (;;) {
+        n++;
+        break;
+        n = 1000;
+    }
+    return n;
+}
+
+static int cases(int x) {
+    switch (x) {
+    case 1:
+        return 10;
+        x = 0;
+    case 2:
+        x = 20;
+        break;
+        x = 0;
+    default:
+        x = 30;
+    }
+    return x;
+}
+
+static int logical(int x) {
+    return (0 && x) + (1 || x) + (DEBUG && unused_func());
+}
+
+void testmain() {
+    print("dead code");
+    expect(3, after_return(3));
+    expect(5, goto_into_dead());
+    expect(2, dead_branches(1));
+    expect(5, loops());
+    expect(10, cases(1));
+    expect(20, cases(2));
+    expect(30, cases(3));
+    expect(1, logical(5));
+    int (*fnptr)(void) = used_func;
+    expect(5, fnptr());
+}
@@ -0,0 +1,47 @@
+#!/bin/bash
+# Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+# Checks the DWARF debug information emitted with -g, and the source
+# line comments printed after .loc directives.
+
+function fail {
+    echo -n -e '\e[1;31m[ERROR]\e[0m '
+    echo "$1"
+    exit 1
+}
+
+./8cc -w -g -c -o tmp.o test/unwind.c || fail "Failed to compile with -g"
+info="$(readelf --debug-dump=info tmp.o)" || fail "readelf failed"
+echo "$info" | grep -q 'DW_AT_producer.*8cc' || fail "No compilation unit"
+echo "$info" | grep -A3 'DW_TAG_subprogram' | grep -q 'DW_AT_name.*depth3' || fail "No DIE for depth3"
+echo "$info" | grep -A3 'DW_TAG_variable' | grep -q 'DW_AT_name.*buf' || fail "No DIE for buf"
+echo "$info" | grep -q 'DW_OP_fbreg' || fail "No frame-relative location"
+readelf --debug-dump=line tmp.o | grep -q 'unwind.c' || fail "No line number program"
+
+# Tagged structs and unions are named; untagged ones are not.
+cat > tmp.c <<EOF
+struct point { int x, y; } p;
+union num { int i; float f; } n;
+struct { int z; } anon;
+EOF
+./8cc -w -g -c -o tmp.o tmp.c || fail "Failed to compile structs with -g"
+info="$(readelf --debug-dump=info tmp.o)" || fail "readelf failed"
+echo "$info" | grep -A1 'DW_TAG_structure_type' | grep -q 'DW_AT_name.*point' || fail "No name for struct point"
+echo "$info" | grep -A1 'DW_TAG_union_type' | grep -q 'DW_AT_name.*num' || fail "No name for union num"
+[ "$(echo "$info" | grep -A1 'DW_TAG_structure_type' | grep -c 'DW_AT_byte_size')" = 1 ] ||
+    fail "Untagged struct has a name"
+
+# Each "# ..." comment must be the line named by the preceding .loc.
+function check_source {
+    ./8cc -w -Itest -S -o tmp.s $1 || fail "Failed to compile $1"
+    awk 'NR == FNR { src[FNR] = $0; next }
+         /\.loc 1 / { line = $3; next }
+         /^\t# / && line { if (substr($0, 4) != src[line]) exit 1; n++; line = 0 }
+         END { exit n == 0 }' test/unwind.c tmp.s || fail "Wrong source comments for $1"
+}
+check_source test/unwind.c
+sed 's/$/\r/' test/unwind.c > tmp.c
+check_source tmp.c
+
+rm -f tmp.o tmp.s tmp.c
+echo "Debug info tests passed"
@@ -75,9 +75,26 @@ void std() {
 #endif
 }
 
+void deref() {
+    float f;
+    double d;
+    float *fp = &f;
+    double *dp = &d;
+    *fp = 1.5;
+    *dp = 2.5;
+    expectf(1.5, f);
+    expectd(2.5, d);
+    struct { int x; float f; double d; } s, *p = &s;
+    p->f = 3.5;
+    p->d = 4.5;
+    expectf(3.5, s.f);
+    expectd(4.5, s.d);
+}
+
 void testmain() {
     print("float");
     std();
+    deref();
 
     expect(0.7, .7);
     float v1 = 10.0;
@@ -105,6 +105,21 @@ static void test_array() {
     expect(23, _Generic((int*)NULL, int[1]: 22, default: 23));
 }
 
+static int add1(int x) { return x + 1; }
+
+static void test_derived() {
+    static char *sp;
+    char *p;
+    char **pp;
+    long a[3];
+    expect(30, _Generic(sp, char *: 30, char **: 31, default: 32));
+    expect(30, _Generic(p, char **: 31, char *: 30, default: 32));
+    expect(31, _Generic(pp, char *: 30, char **: 31, default: 32));
+    expect(33, _Generic(&a, long (*)[3]: 33, long (*)[4]: 34, default: 35));
+    expect(36, _Generic(&add1, int (*)(int): 36, default: 37));
+    expect(38, _Generic(&p, char **: 38, default: 39));
+}
+
 void testmain() {
     print("_Generic");
     test_basic();
@@ -112,6 +127,7 @@ void testmain() {
     test_default();
     test_struct();
     test_array();
+    test_derived();
 }
 
 #else
@@ -58,6 +58,33 @@
 # error "include guard"
 #endif
 
+#include "includeguard8.h"
+#if __8cc_include_guard == 1
+# error "include guard"
+#endif
+#include "includeguard8.h"
+#if __8cc_include_guard == 0
+# error "include guard"
+#endif
+
+#include "includeguard9.h"
+#if __8cc_include_guard == 1
+# error "include guard"
+#endif
+#include "includeguard9.h"
+#if __8cc_include_guard == 0
+# error "include guard"
+#endif
+
+#include "includeguard10.h"
+#if __8cc_include_guard == 1
+# error "include guard"
+#endif
+#include "includeguard10.h"
+#if __8cc_include_guard == 1
+# error "include guard"
+#endif
+
 #endif
 
 void testmain() {
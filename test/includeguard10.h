@@ -0,0 +1,5 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+#if !defined(INCLUDEGUARD10_H) && 1
+#define INCLUDEGUARD10_H
+#endif
@@ -0,0 +1,8 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * A comment before the guard.
+ */
+#if !defined(INCLUDEGUARD8_H)
+#define INCLUDEGUARD8_H
+#endif
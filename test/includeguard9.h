@@ -0,0 +1,5 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+#if ! defined INCLUDEGUARD9_H
+#define INCLUDEGUARD9_H
+#endif
@@ -154,6 +154,18 @@ static void test_zero() {
 }
 
 
+static void test_static() {
+    static int ze[] = { 1, 0, 0, 2, 3, 0, 4, 5, 6, 0, 7, 0 };
+    static int z[4][3] = { { 1 }, { 2, 3 }, { 4, 5, 6 }, { 0, 7 } };
+    verify(ze, (int *)z, 12);
+    static struct { char a; int b; char c; long d; } s[2] = { { 1, 2 }, { 3, 4, 5, 6 } };
+    expect(2, s[0].b);
+    expect(0, s[0].d);
+    expect(3, s[1].a);
+    expect(5, s[1].c);
+    expectl(6, s[1].d);
+}
+
 static void test_typedef() {
     typedef int A[];
     A a = { 1, 2 };
@@ -191,6 +203,7 @@ void testmain() {
     test_struct_designator();
     test_complex_designator();
     test_zero();
+    test_static();
     test_typedef();
     test_excessive();
 }
@@ -0,0 +1,98 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include "test.h"
+#include <stdarg.h>
+
+static int add(int a, int b) { return a + b; }
+static inline int max(int a, int b) { return a > b ? a : b; }
+static int twice(int a) { return add(a, a); }
+static double half(double x) { return x / 2; }
+static _Bool nonzero(long x) { return x; }
+
+static int sign(int x) {
+    if (x < 0)
+        return -1;
+    if (x == 0)
+        return 0;
+    return 1;
+}
+
+static int abs2(int x) {
+    int r = x;
+    if (r < 0)
+        r = -r;
+    return r;
+}
+
+static int counter;
+static void bump(int n) { counter += n; }
+static int next(void) { return ++counter; }
+
+static int fact(int n) { return n <= 1 ? 1 : n * fact(n - 1); }
+static int is_even(int n);
+static int is_odd(int n) { return n == 0 ? 0 : is_even(n - 1); }
+static int is_even(int n) { return n == 0 ? 1 : is_odd(n - 1); }
+
+static int sum(int n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    int r = 0;
+    for (int i = 0; i < n; i++)
+        r += va_arg(ap, int);
+    va_end(ap);
+    return r;
+}
+
+static int first(int *p) { return (int[]){ p[0], p[1] }[0]; }
+static int calls(void) { static int n; return ++n; }
+static void set(int *p, int v) { *p = v; }
+
+static void test_basic() {
+    expect(5, add(2, 3));
+    expect(7, max(7, 3));
+    expect(7, max(3, 7));
+    expect(10, twice(5));
+    expectd(1.5, half(3));
+    expect(1, nonzero(1L << 40));
+    expect(0, nonzero(0));
+}
+
+static void test_branch() {
+    expect(-1, sign(-5));
+    expect(0, sign(0));
+    expect(1, sign(5));
+    expect(3, abs2(-3));
+    expect(3, abs2(3));
+}
+
+static void test_side_effect() {
+    counter = 0;
+    expect(2, twice(next()));
+    expect(1, counter);
+    expect(5, max(next(), 5));
+    expect(2, counter);
+    bump(3);
+    expect(5, counter);
+}
+
+static void test_conservative() {
+    expect(120, fact(5));
+    expect(1, is_even(10));
+    expect(0, is_odd(10));
+    expect(6, sum(3, 1, 2, 3));
+    int a[] = { 3, 4 };
+    expect(3, first(a));
+    expect(1, calls());
+    expect(2, calls());
+    int x = 0;
+    set(&x, 42);
+    expect(42, x);
+}
+
+void testmain() {
+    print("inline");
+    test_basic();
+    test_branch();
+    test_side_effect();
+    test_conservative();
+}
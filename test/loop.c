@@ -0,0 +1,104 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include "test.h"
+
+static int garr[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+
+static int sum(int *a, int n) {
+    int r = 0;
+    for (int i = 0; i < n; i++)
+        r += a[i];
+    return r;
+}
+
+static long sum_step(char *p, long n) {
+    long r = 0;
+    int i = 0;
+    while (i < n) {
+        r += p[i];
+        i += 2;
+    }
+    return r;
+}
+
+static int sum_down(void) {
+    int r = 0;
+    int i = 9;
+    do {
+        r = r * 2 + garr[i];
+        i--;
+    } while (i >= 7);
+    return r;
+}
+
+static int matrix(int n, int m) {
+    int a[4][5];
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < m; j++)
+            a[i][j] = i * m + j;
+    int r = 0;
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < m; j++)
+            r += a[i][j] * (n + m);
+    return r;
+}
+
+static int skip(int *a, int n) {
+    int r = 0;
+    for (int i = 0; i < n; i++) {
+        if (a[i] == 3)
+            i++;
+        r += a[i];
+    }
+    return r;
+}
+
+static int moving_base(int *a, int n) {
+    int r = 0;
+    for (int i = 0; i < n; i++) {
+        r += a[i];
+        a++;
+    }
+    return r;
+}
+
+static int goto_loop(int *a, int n) {
+    int r = 0, i = 0;
+    if (n > 5) {
+        i = 5;
+        goto inside;
+    }
+again:
+    r += a[i];
+inside:
+    i++;
+    if (i < n)
+        goto again;
+    return r;
+}
+
+typedef struct { int x, y; } Point;
+
+static int points(Point *p, int n) {
+    int r = 0;
+    for (int i = 0; i < n; i++)
+        r += p[i].x * p[i].y;
+    return r;
+}
+
+void testmain() {
+    print("loop");
+    int a[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    expect(36, sum(a, 8));
+    expect(0, sum(a, 0));
+    expect(16, sum_step("\1\2\3\4\5\6\7", 7));
+    expect(66, sum_down());
+    expect(1710, matrix(4, 5));
+    expect(33, skip(a, 8));
+    expect(16, moving_base(a, 4));
+    expect(10, goto_loop(a, 4));
+    expect(7, goto_loop(a, 7));
+    Point p[] = { { 1, 2 }, { 3, 4 }, { 5, 6 } };
+    expect(44, points(p, 3));
+    expect(55, sum(garr, 10));
+}
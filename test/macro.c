@@ -129,6 +129,43 @@ static void undef() {
 #undef a
 }
 
+#define MEMO1 MEMO2 + 1
+#define MEMO2 10
+#define MEMO_FN(x) x * 2
+#define MEMO_NAME MEMO_FN
+#define MEMO_LINE __LINE__
+
+static void memo() {
+    // Object-like macros are expanded once and reused until a macro
+    // is defined or undefined.
+    expect(11, MEMO1);
+    expect(11, MEMO1);
+#undef MEMO2
+    int MEMO2 = 3;
+    expect(4, MEMO1);
+#define MEMO2 20
+    expect(21, MEMO1);
+    expect(21, MEMO1);
+    // Expansions that depend on the context are not reused.
+    expect(6, MEMO_NAME(3));
+    expect(8, MEMO_NAME(4));
+    int a = MEMO_LINE;
+    expect(a + 1, MEMO_LINE);
+    // The operand of "defined" is not expanded.
+#define MEMO_X 1
+#define MEMO_HAS_X defined(MEMO_X)
+#if MEMO_HAS_X
+    a = 5;
+#else
+    a = 6;
+#endif
+    expect(5, a);
+#if MEMO_HAS_X
+    a = 7;
+#endif
+    expect(7, a);
+}
+
 static void cond_incl() {
     int a = 1;
 #if 0
@@ -192,6 +229,30 @@ xyz "\"/*" '\'/*'
     a = 150;
 #endif
     expect(150, a);
+
+#if 0
+    // don't /* start a comment
+  /**/ # /**/ ifdef X
+#  else
+    #endif
+#define SKIPPED \
+#endif
+    fail("if 0");
+#else
+    a = 151;
+#endif
+    expect(151, a);
+
+    int line = __LINE__;
+#if 0
+    'unterminated
+    x \
+#endif
+    /*
+#endif
+     */
+#endif
+    expect(line + 9, __LINE__);
 }
 
 static void const_expr() {
@@ -280,6 +341,27 @@ static void const_expr() {
     a = 13;
 #endif
     expect(12, a);
+
+    // C11 6.10.1p4: intmax_t and uintmax_t arithmetic
+#if 0x100000000 * 2 != 0x200000000 || 4294967296 == 0
+    fail("intmax_t");
+#endif
+#if -1 > 0u && -1 < 0 && 0xFFFFFFFFFFFFFFFF > 0 && (-1 >> 63) == -1 && (-1u >> 63) == 1
+    a = 16;
+#endif
+    expect(16, a);
+#if 1 ? 2 : (1 / 0)
+    a = 17;
+#endif
+    expect(17, a);
+#if (0 && 1 / 0) || (1 || 1 % 0) && 'a' == 97 && '\377' < 0
+    a = 18;
+#endif
+    expect(18, a);
+#if (2 || 3) == 1 && (0 ? 1u : -1) > 0 && ~0 == -1 && -9223372036854775807 - 1 < 0
+    a = 19;
+#endif
+    expect(19, a);
 }
 
 static void defined() {
@@ -448,6 +530,12 @@ static void funclike() {
 
 #define m17(x) stringify(.x . x)
     expect_string(".3 . 3", m17(3));
+
+    // An argument is expanded once and reused, keeping the spacing
+    // of each use; one used only with # is not expanded.
+#define m18(x, y) stringify(x y(x)y #y)
+    expect_string("aa aa(aa)aa \"m10(a)\"", m18(m10(a), m10(a)));
+    expect(4, m15(TWO +) 0);
 }
 
 static void empty() {
@@ -499,6 +587,7 @@ void testmain() {
     simple();
     loop();
     undef();
+    memo();
     cond_incl();
     const_expr();
     defined();
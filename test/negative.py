@@ -80,6 +80,21 @@ x(1, 2)
 ! 1:9: identifier expected, but got "abc"
 #ifndef "abc"
 
+! 1:1: no expression in #if
+#if
+
+! 1:7: stray token: 2
+#if 1 2
+
+! 1:5: string literal is not allowed in #if
+#if "abc"
+
+! 1:7: division by zero in #if
+#if 1 / 0
+
+! 1:1: premature end of #if expression
+#if (1 +
+
 ! 1:1: stray #else
 #else
 
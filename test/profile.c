@@ -0,0 +1,45 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+// test/profile.sh also builds this file with -fprofile-generate and
+// -fprofile-use.
+
+#include "test.h"
+
+int verbose;
+
+void report(int n) {
+    print("unreachable");
+    expect(0, n);
+}
+
+static int classify(int x) {
+    if (x < 0)
+        return -1;
+    if (x % 16 == 0) {
+        if (verbose)
+            report(x);
+        return 2;
+    } else {
+        return x > 100 ? 3 : 1;
+    }
+}
+
+static int sum(int n) {
+    int r = 0;
+    for (int i = -2; i < n; i++)
+        r += classify(i);
+    return r;
+}
+
+static long fib(int n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+void testmain() {
+    print("profile");
+    expect(-2, classify(-2) + classify(-1));
+    expect(2, classify(32));
+    expect(3, classify(101));
+    expect(105, sum(100));
+    expectl(6765, fib(20));
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+# Builds test/profile.c with -fprofile-generate, runs it twice to collect
+# a profile, and rebuilds and runs it with -fprofile-use. Then builds it
+# with -finstrument-functions and -finstrument-functions=cycles.
+
+function fail {
+    echo -n -e '\e[1;31m[ERROR]\e[0m '
+    echo "$1"
+    exit 1
+}
+
+prof=$(pwd)/tmp.prof
+rm -f $prof
+
+./8cc -w -fprofile-generate=$prof -c -o tmp.o test/profile.c || fail "Failed to compile with -fprofile-generate"
+cc -o tmp.bin tmp.o test/testmain.o $LDFLAGS || fail "Failed to link"
+./tmp.bin > /dev/null || fail "Instrumented binary failed"
+./tmp.bin > /dev/null || fail "Instrumented binary failed"
+[ "$(grep -c 8cc-profile $prof)" = 2 ] || fail "Expected two profile records"
+
+./8cc -w -fprofile-use=$prof -S -o tmp.s test/profile.c || fail "Failed to compile with -fprofile-use"
+# report() never runs and fib() is the hottest function.
+grep -A3 'section .text.unlikely' tmp.s | grep -q '^report:' || fail "report() is not in .text.unlikely"
+grep -A2 'section .text.hot' tmp.s | grep -q '^fib:' || fail "fib() is not in .text.hot"
+grep -q 'pushsection .text.unlikely' tmp.s || fail "No out-of-line cold block"
+
+./8cc -w -fprofile-use=$prof -c -o tmp.o test/profile.c || fail "Failed to compile with -fprofile-use"
+cc -o tmp.bin tmp.o test/testmain.o $LDFLAGS || fail "Failed to link"
+./tmp.bin > /dev/null || fail "Optimized binary failed"
+
+cat > tmp.c <<EOF
+#include <stdio.h>
+static long enter, leave;
+void __cyg_profile_func_enter(void *fn, void *site) { enter++; }
+void __cyg_profile_func_exit(void *fn, void *site) { leave++; }
+__attribute__((destructor)) static void report(void) { printf("%ld %ld\n", enter, leave); }
+EOF
+./8cc -w -finstrument-functions -c -o tmp.o test/profile.c || fail "Failed to compile with -finstrument-functions"
+cc -c -o tmp2.o tmp.c || fail "Failed to compile hooks"
+cc -o tmp.bin tmp.o tmp2.o test/testmain.o $LDFLAGS || fail "Failed to link"
+# 106 calls of classify, 21891 of fib, and sum, testmain and report.
+[ "$(./tmp.bin | tail -1)" = "21999 21999" ] || fail "Wrong number of hook calls"
+
+./8cc -w -finstrument-functions=cycles -c -o tmp.o test/profile.c || fail "Failed to compile with -finstrument-functions=cycles"
+cc -o tmp.bin tmp.o test/testmain.o $LDFLAGS || fail "Failed to link"
+./tmp.bin 2>&1 >/dev/null | grep -q '^fib  *21891 calls  *[0-9]* cycles$' || fail "Wrong cycle table"
+
+rm -f $prof tmp.c tmp.o tmp2.o tmp.s tmp.bin
+echo "Profile tests passed"
@@ -0,0 +1,76 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include <setjmp.h>
+#include "test.h"
+
+static int id(int x) { return x; }
+int ext(int x) { return x + 1; }
+
+static void test_loop() {
+    int sum = 0;
+    for (int i = 0; i < 100; i++)
+        sum += ext(i);
+    expect(5050, sum);
+}
+
+static void test_many() {
+    int a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7;
+    for (int i = 0; i < 3; i++) {
+        a += ext(b);
+        b += ext(c);
+        c += ext(d);
+        d += ext(e);
+        e += ext(f);
+        f += ext(g);
+        g += ext(a);
+    }
+    expect(27, a);
+    expect(52, g);
+}
+
+static void test_types() {
+    char c = 127;
+    c++;
+    expect(-128, c);
+    unsigned char uc = 255;
+    uc++;
+    expect(0, uc);
+    short s = 70000;
+    expect(4464, s);
+    unsigned u = -1;
+    expectl(4294967295L, u);
+    _Bool b = 42;
+    expect(1, b);
+    long l = 1L << 40;
+    expectl(1L << 40, l + ext(-1));
+    char *p = "abc";
+    p++;
+    expect('b', *p);
+}
+
+static int params(int a, char b, long c) {
+    int r = ext(a) + ext(b);
+    return r + c + a + b;
+}
+
+static jmp_buf buf;
+
+static void jump(void) { longjmp(buf, 1); }
+
+static int after_setjmp(void) {
+    int x = 0;
+    if (setjmp(buf))
+        return x;
+    x = ext(4);
+    jump();
+    return -1;
+}
+
+void testmain() {
+    print("register variable");
+    test_loop();
+    test_many();
+    test_types();
+    expect(18, params(3, id(2), 6));
+    expect(5, after_setjmp());
+}
@@ -0,0 +1,78 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include "test.h"
+
+// These recurse far deeper than the stack would allow without
+// tail call elimination.
+
+long sum(long n, long acc) {
+    if (n == 0)
+        return acc;
+    return sum(n - 1, acc + n);
+}
+
+int is_odd(int n);
+
+int is_even(int n) {
+    if (n == 0)
+        return 1;
+    return is_odd(n - 1);
+}
+
+int is_odd(int n) {
+    if (n == 0)
+        return 0;
+    return is_even(n - 1);
+}
+
+double fsum(int n, double acc) {
+    return n == 0 ? acc : fsum(n - 1, acc + 0.5);
+}
+
+double fsum2(int n, double acc) {
+    if (n == 0)
+        return acc;
+    return fsum2(n - 1, acc + 0.5);
+}
+
+int count_down(int n, int (*fn)(int, int (*)()));
+
+int next(int n, int (*fn)()) {
+    return n == 0 ? 0 : fn(n - 1, next);
+}
+
+int count_down(int n, int (*fn)()) {
+    if (n == 0)
+        return 42;
+    return fn(n - 1, count_down);
+}
+
+// The address of a local escapes, so these must not reuse the frame.
+int chain(int n, int *prev) {
+    int x = n;
+    if (n == 0)
+        return *prev;
+    return chain(n - 1, &x);
+}
+
+int add3(int a, int b, int c) {
+    return a + b + c;
+}
+
+int shuffle(int a, int b, int c) {
+    return add3(c, a, b);
+}
+
+void testmain() {
+    print("tail call");
+    expectl(50000005000000L, sum(10000000, 0));
+    expect(1, is_even(10000000));
+    expect(0, is_odd(10000000));
+    expectd(5000000.0, fsum(10000000, 0));
+    expectd(5000000.0, fsum2(10000000, 0));
+    int x = 99;
+    expect(1, chain(1, &x));
+    expect(99, chain(0, &x));
+    expect(6, shuffle(1, 2, 3));
+    expect(0, next(10000000, count_down));
+}
@@ -0,0 +1,25 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+// The unwinder needs call frame information to walk the stack.
+
+#include <execinfo.h>
+#include "test.h"
+
+int depth3(void) {
+    void *buf[32];
+    return backtrace(buf, 32);
+}
+
+int depth2(void) {
+    return 1 + depth3();
+}
+
+int depth1(void) {
+    return 1 + depth2();
+}
+
+void testmain() {
+    print("unwind");
+    int n = depth3();
+    expect(n + 2, depth1() - 2);
+}
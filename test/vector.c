@@ -0,0 +1,118 @@
+// Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+#include "test.h"
+
+static int garr[19];
+static int zero[12];
+
+static void add(int *a, int *b, int *c, int n) {
+    for (int i = 0; i < n; i++)
+        a[i] = b[i] + c[i];
+}
+
+static void fill(int *a, int v, int n) {
+    for (int i = 0; i < n; i++)
+        a[i] = v;
+}
+
+static void scale(float *a, float x, int n) {
+    for (int i = 0; i < n; i++)
+        a[i] = a[i] * x + 1.0f;
+}
+
+static void axpy(double *y, double *x, double a, long n) {
+    for (long i = 0; i < n; i++)
+        y[i] = a * x[i] + y[i];
+}
+
+static void mask(long *a, long *b, long m, int n) {
+    for (int i = 0; i < n; i++)
+        a[i] = (b[i] & m) ^ 3;
+}
+
+static int sum(int *a, int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i];
+    return s;
+}
+
+static long lsum(long *a, int n) {
+    long s = 100;
+    for (int i = 0; i < n; i++)
+        s += a[i] - 1;
+    return s;
+}
+
+static void test_int() {
+    int a[19], b[19], c[19];
+    for (int i = 0; i < 19; i++) {
+        b[i] = i;
+        c[i] = i * 10;
+    }
+    add(a, b, c, 19);
+    expect(0, a[0]);
+    expect(33, a[3]);
+    expect(198, a[18]);
+    add(a, b, c, 0);
+    expect(33, a[3]);
+    fill(garr, 7, 19);
+    expect(7, garr[0]);
+    expect(7, garr[18]);
+    fill(garr, 3, 5);
+    expect(3, garr[4]);
+    expect(7, garr[5]);
+    expect(171, sum(b, 19));
+    expect(6, sum(b, 4));
+    expect(0, sum(b, 0));
+}
+
+static void test_float() {
+    float f[9];
+    for (int i = 0; i < 9; i++)
+        f[i] = i;
+    scale(f, 0.5, 9);
+    expectf(1.0, f[0]);
+    expectf(2.5, f[3]);
+    expectf(5.0, f[8]);
+    double x[7], y[7];
+    for (int i = 0; i < 7; i++) {
+        x[i] = i;
+        y[i] = 1;
+    }
+    axpy(y, x, 2, 7);
+    expectd(1, y[0]);
+    expectd(13, y[6]);
+}
+
+static void test_long() {
+    long a[5], b[5] = { 1, 2, 0xff, 0x100, -1 };
+    mask(a, b, 0xf0, 5);
+    expectl(3, a[0]);
+    expectl(0xf3, a[2]);
+    expectl(0xf3, a[4]);
+    expectl(355, lsum(b, 3));
+}
+
+static void test_overlap() {
+    int a[12];
+    for (int i = 0; i < 12; i++)
+        a[i] = i;
+    // a[i + 1] = a[i] + 0 propagates a[0] to the whole array.
+    add(a + 1, a, zero, 11);
+    expect(0, a[11]);
+    for (int i = 0; i < 12; i++)
+        a[i] = i;
+    add(a, a + 1, zero, 11);
+    expect(11, a[10]);
+    add(a, a, a, 12);
+    expect(22, a[10]);
+}
+
+void testmain() {
+    print("vectorization");
+    test_int();
+    test_float();
+    test_long();
+    test_overlap();
+}
@@ -41,6 +41,10 @@ static void test_buf() {
     buf_write(b2, '.');
     buf_printf(b2, "%s", "0123456789");
     assert_string(".0123456789", buf_body(b2));
+
+    assert_string("", quote_cstring(""));
+    assert_string("", quote_cstring_len("", 0));
+    assert_string("a\\n", quote_cstring_len("a\n", 2));
 }
 
 static void test_list() {